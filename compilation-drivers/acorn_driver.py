@@ -10,12 +10,17 @@ import os
 
 
 if __name__ == '__main__':
+    # Build into jknit's private scratch directory, if given
+    binary: str = os.path.join(os.environ.get('JKNIT_SCRATCH', '.'),
+                               f'{os.getpid()}.out')
+
     try:
         result: int = os.system(
-            f'acorn -Me {sys.argv[1]} -o a.out > /dev/null')
+            f'acorn -Me {sys.argv[1]} -o {binary} > /dev/null')
 
         assert result == 0
-        result = os.system('./a.out')
+        result = os.system(binary)
         assert result == 0
     finally:
-        os.system('rm a.out')
+        if os.path.exists(binary):
+            os.remove(binary)
@@ -12,13 +12,14 @@ def compile_and_run(compiler_name: str) -> None:
     by argv[1] to an executable and runs it.
     '''
 
-    name: str = f'{os.getpid()}.out'
+    name: str = os.path.join(os.environ.get('JKNIT_SCRATCH', '.'),
+                             f'{os.getpid()}.out')
 
     try:
         subprocess.call(compiler_name.split(' ') +
                         [os.sys.argv[1], '-o', name],
                         stdout=subprocess.DEVNULL)
-        subprocess.call([f'./{name}'], stdout=os.sys.stdout)
+        subprocess.call([name], stdout=os.sys.stdout)
 
     finally:
         os.remove(name)
@@ -0,0 +1,144 @@
+#!/usr/bin/python3
+
+'''
+Checkpointing driver for Python sessions under `jknit --watch`.
+Rather than reading a whole session from stdin, each chunk is
+run on request in one long-lived namespace. After each chunk, a
+stopped `fork()` of the interpreter can be left behind, so that
+when a chunk is edited, jknit can resume from the copy taken
+just before it rather than re-running the session from the top.
+
+On starting, one line is written back: This process's pid.
+
+Requests are read from stdin, one per line: The source file, the
+file to write its stdout to, its scratch directory and whether
+to leave a copy behind (1 or 0), separated by tabs. One line is
+written back per request: The exit status, the pid of the copy
+(or 0), then max RSS in KB and the chunk's user and system time
+in microseconds.
+
+Copies are stopped with SIGSTOP. Once jknit has killed the
+interpreter it was talking to, it resumes a copy with SIGCONT.
+The copy leaves a copy of itself behind in turn, writes that
+copy's pid back as a line, and carries on serving requests.
+Copies are orphaned, so they need never be reaped, and are sent
+SIGHUP by the kernel (along with the rest of their process
+group) should jknit die without killing them.
+Jordan Dehmel, 2023-present
+'''
+
+import os
+import resource
+import signal
+import sys
+import traceback
+
+
+def run_chunk(namespace: dict, source: str, output: str,
+              scratch: str) -> int:
+    '''
+    Runs the given file in `namespace` with its stdout sent to
+    `output`, returning its exit status.
+    '''
+
+    fd: int = os.open(output, os.O_WRONLY | os.O_CREAT |
+                      os.O_TRUNC, 0o600)
+    sys.stdout.flush()
+    os.dup2(fd, 1)
+    os.close(fd)
+
+    os.environ['JKNIT_SCRATCH'] = scratch
+
+    try:
+        with open(source) as f:
+            code = compile(f.read(), source, 'exec')
+        exec(code, namespace)
+        return 0
+
+    except SystemExit as e:
+        if e.code is None:
+            return 0
+        elif isinstance(e.code, int):
+            return e.code
+        print(e.code, file=sys.stderr)
+        return 1
+
+    except BaseException:
+        traceback.print_exc()
+        return 1
+
+    finally:
+        sys.stdout.flush()
+        sys.stderr.flush()
+        os.dup2(2, 1)
+
+
+def leave_copy() -> tuple[int, bool]:
+    '''
+    Leaves a stopped copy of this interpreter behind, returning
+    its pid and False. Should jknit resume that copy, this also
+    returns there, having left a copy behind in turn, with True.
+    '''
+
+    resumed: bool = False
+    while True:
+        read_end, write_end = os.pipe()
+        child: int = os.fork()
+        if child != 0:
+            os.close(write_end)
+            os.waitpid(child, 0)
+            with os.fdopen(read_end) as f:
+                return int(f.readline()), resumed
+
+        # The copy is a grandchild, so that its parent is init
+        os.close(read_end)
+        if os.fork() != 0:
+            os._exit(0)
+        os.write(write_end, f'{os.getpid()}\n'.encode())
+        os.close(write_end)
+
+        os.kill(os.getpid(), signal.SIGSTOP)
+        resumed = True
+
+
+def main() -> None:
+    '''
+    Serves requests until stdin closes.
+    '''
+
+    # Keep requests and replies away from the chunks
+    requests = os.fdopen(os.dup(0), 'r')
+    replies = os.fdopen(os.dup(1), 'w')
+    fd: int = os.open(os.devnull, os.O_RDONLY)
+    os.dup2(fd, 0)
+    os.close(fd)
+    os.dup2(2, 1)
+
+    replies.write(f'{os.getpid()}\n')
+    replies.flush()
+
+    namespace: dict = {'__name__': '__main__'}
+    for line in iter(requests.readline, ''):
+        source, output, scratch, keep = \
+            line.rstrip('\n').split('\t')
+
+        before = resource.getrusage(resource.RUSAGE_SELF)
+        status: int = run_chunk(namespace, source, output,
+                                scratch)
+        after = resource.getrusage(resource.RUSAGE_SELF)
+        user_us = int((after.ru_utime - before.ru_utime) * 1e6)
+        sys_us = int((after.ru_stime - before.ru_stime) * 1e6)
+
+        copy, resumed = 0, False
+        if keep == '1':
+            copy, resumed = leave_copy()
+        if resumed:
+            replies.write(f'{copy}\n')
+        else:
+            replies.write(f'{status} {copy} {after.ru_maxrss} '
+                          f'{user_us} {sys_us}\n')
+        replies.flush()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,98 @@
+#!/usr/bin/python3
+
+'''
+Fork server for Python chunks. Imports the modules named on the
+command line once, then runs each requested file in a forked
+child, so that no chunk pays for those imports and no chunk sees
+another's state.
+
+Requests are read from stdin, one per line: The source file, the
+file to write its stdout to and its scratch directory, separated
+by tabs. One line is written back per request: The exit status,
+then the child's max RSS in KB and its user and system time in
+microseconds.
+Jordan Dehmel, 2023-present
+'''
+
+import importlib
+import os
+import runpy
+import sys
+import traceback
+
+
+def run_chunk(source: str, output: str, scratch: str) -> int:
+    '''
+    Runs the given file as `__main__` with its stdout sent to
+    `output`, returning its exit status. Only ever called in a
+    freshly forked child.
+    '''
+
+    fd: int = os.open(output, os.O_WRONLY | os.O_CREAT |
+                      os.O_TRUNC, 0o600)
+    os.dup2(fd, 1)
+    os.close(fd)
+
+    fd = os.open(os.devnull, os.O_RDONLY)
+    os.dup2(fd, 0)
+    os.close(fd)
+
+    os.environ['JKNIT_SCRATCH'] = scratch
+    sys.argv = [source]
+
+    try:
+        runpy.run_path(source, run_name='__main__')
+        return 0
+
+    except SystemExit as e:
+        if e.code is None:
+            return 0
+        elif isinstance(e.code, int):
+            return e.code
+        print(e.code, file=sys.stderr)
+        return 1
+
+    except BaseException:
+        traceback.print_exc()
+        return 1
+
+    finally:
+        sys.stdout.flush()
+        sys.stderr.flush()
+
+
+def main() -> None:
+    '''
+    Preloads modules, then serves requests until stdin closes.
+    '''
+
+    # Keep the reply channel away from anything which prints
+    replies = os.fdopen(os.dup(1), 'w')
+    os.dup2(2, 1)
+
+    for name in sys.argv[1:]:
+        try:
+            importlib.import_module(name)
+        except ImportError as e:
+            print(f'WARNING: Could not preload {name}: {e}',
+                  file=sys.stderr)
+
+    for line in sys.stdin:
+        source, output, scratch = line.rstrip('\n').split('\t')
+        sys.stdout.flush()
+
+        pid: int = os.fork()
+        if pid == 0:
+            replies.close()
+            os._exit(run_chunk(source, output, scratch))
+
+        _, status, usage = os.wait4(pid, 0)
+        replies.write(f'{os.waitstatus_to_exitcode(status)} '
+                      f'{usage.ru_maxrss} '
+                      f'{int(usage.ru_utime * 1e6)} '
+                      f'{int(usage.ru_stime * 1e6)}\n')
+        replies.flush()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,144 @@
+/*
+Host for C and C++ chunks built as shared objects (as with
+`-shared -fPIC`). The C++ runtime is loaded once, up front, and
+each chunk is loaded with `dlopen` and its `main` called in a
+forked child. So no chunk pays for `exec`, loading and
+relocating the C++ runtime or libc startup, and no chunk sees
+another's state. Built by `make install` beside this file.
+
+With no arguments, requests are read from stdin as by
+`py_fork_server.py`: The shared object, the file to write its
+stdout to and its scratch directory, separated by tabs. One line
+is written back per request: The exit status, then the child's
+max RSS in KB and its user and system time in microseconds.
+
+With a shared object as its argument, it is run once, directly,
+without forking.
+Jordan Dehmel
+2023 - present
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Loaded (and relocated) before forking, so that each chunk's
+// own `dlopen` finds them already in place. Any which are
+// missing are left to each chunk to load.
+const static char *preload[] = {"libm.so.6", "libgcc_s.so.1",
+                                "libstdc++.so.6"};
+
+// Load the given shared object and return what its `main`
+// returns. Its constructors run on load.
+static int call_main(const char *_library)
+{
+    void *handle = dlopen(_library, RTLD_NOW);
+    void *entry = handle ? dlsym(handle, "main") : nullptr;
+    if (entry == nullptr)
+    {
+        std::cerr << "Could not load main from " << _library
+                  << ": " << dlerror() << '\n';
+        return 127;
+    }
+
+    using Main = int (*)(int, char **);
+    char *argv[] = {const_cast<char *>(_library), nullptr};
+    return reinterpret_cast<Main>(entry)(1, argv);
+}
+
+// Run the given shared object with its stdout sent to
+// `_output`, then exit. Only ever called in a freshly forked
+// child.
+[[noreturn]] static void run_chunk(const std::string &_library,
+                                   const std::string &_output,
+                                   const std::string &_scratch)
+{
+    int fd = open(_output.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || dup2(fd, 1) < 0)
+    {
+        _exit(127);
+    }
+    close(fd);
+
+    fd = open("/dev/null", O_RDONLY);
+    dup2(fd, 0);
+    close(fd);
+
+    setenv("JKNIT_SCRATCH", _scratch.c_str(), 1);
+
+    // As if `main` had returned: C stdio is flushed and static
+    // destructors are run
+    exit(call_main(_library.c_str()));
+}
+
+// Serve requests until stdin closes, or run one chunk
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+    {
+        return call_main(argv[1]);
+    }
+
+    // Keep the reply channel away from anything which prints
+    FILE *replies = fdopen(dup(1), "w");
+    dup2(2, 1);
+    for (const auto name : preload)
+    {
+        dlopen(name, RTLD_NOW | RTLD_GLOBAL);
+    }
+
+    std::string line;
+    while (getline(std::cin, line))
+    {
+        const auto first = line.find('\t');
+        const auto second = line.find('\t', first + 1);
+        if (second == std::string::npos)
+        {
+            std::cerr << "Malformed request '" << line
+                      << "'\n";
+            return 1;
+        }
+
+        std::cout.flush();
+        fflush(nullptr);
+
+        const pid_t pid = fork();
+        if (pid == 0)
+        {
+            fclose(replies);
+            run_chunk(
+                line.substr(0, first),
+                line.substr(first + 1, second - first - 1),
+                line.substr(second + 1));
+        }
+
+        int status = 0;
+        struct rusage usage = {};
+        if (pid < 0 || wait4(pid, &status, 0, &usage) < 0)
+        {
+            return 1;
+        }
+
+        // Negative for a signal, as with Python's
+        // `os.waitstatus_to_exitcode`
+        const int code = WIFSIGNALED(status)
+                             ? -WTERMSIG(status)
+                             : WEXITSTATUS(status);
+        fprintf(replies, "%d %ld %ld %ld\n", code,
+                usage.ru_maxrss,
+                usage.ru_utime.tv_sec * 1000000L +
+                    usage.ru_utime.tv_usec,
+                usage.ru_stime.tv_sec * 1000000L +
+                    usage.ru_stime.tv_usec);
+        fflush(replies);
+    }
+
+    return 0;
+}
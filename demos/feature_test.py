@@ -0,0 +1,388 @@
+#!/usr/bin/python3
+
+'''
+Feature suite for JKnit. Knits each input in `features/` with
+the arguments its case gives, from a scratch copy of the
+directory, and compares the targets with the `.expected.*`
+files beside the input. Cases whose output varies from run to
+run check it with a function instead.
+Jordan Dehmel, 2023-present
+'''
+
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from typing import Callable, Dict, List, Optional
+
+FEATURES: str = os.path.join(os.path.dirname(
+    os.path.abspath(__file__)), 'features')
+
+
+def jknit(directory: str, args: List[str],
+          code: int = 0) -> subprocess.CompletedProcess:
+    '''
+    Runs jknit in the given directory, failing unless it exits
+    with `code`. Its history is kept in the directory too.
+    '''
+
+    env: Dict[str, str] = dict(os.environ)
+    env['XDG_CACHE_HOME'] = os.path.join(directory, '.cache')
+    result: subprocess.CompletedProcess = subprocess.run(
+        ['jknit'] + args, cwd=directory, env=env, text=True,
+        stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE, timeout=120)
+
+    assert result.returncode == code, \
+        (f'jknit {" ".join(args)} exited with '
+         f'{result.returncode}, not {code}:\n{result.stderr}')
+    return result
+
+
+def expect(directory: str, target: str,
+           expected: Optional[str] = None) -> None:
+    '''
+    Fails unless `target` matches its expected file, which is
+    named for the case and the target's extension by default.
+    '''
+
+    if expected is None:
+        stem, extension = os.path.splitext(target)
+        expected = stem + '.expected' + extension
+
+    with open(os.path.join(directory, target)) as f:
+        got: str = f.read()
+    with open(os.path.join(FEATURES, expected)) as f:
+        want: str = f.read()
+
+    assert got == want, f'{target} differs from {expected}'
+
+
+def multi_target(directory: str) -> None:
+    '''
+    One parse and execution feeds every target.
+    '''
+
+    jknit(directory, ['multi_target.jmd', '-o',
+                      'multi_target.md', '-o',
+                      'multi_target.tex'])
+    expect(directory, 'multi_target.md')
+    expect(directory, 'multi_target.tex')
+
+
+def multi_target_error(directory: str) -> None:
+    '''
+    An error in the first target halts the knit cleanly while
+    the others are being rendered.
+    '''
+
+    os.mknod(os.path.join(directory, 'multi_target-blocks'))
+    result = jknit(directory, ['multi_target.jmd', '-e',
+                               '--externalize', '1', '-o',
+                               'multi_target.tex', '-o',
+                               'multi_target.md'], code=2)
+    assert 'Failed to write block' in result.stderr, \
+        result.stderr
+
+
+def timer(directory: str) -> None:
+    '''
+    With `-t`, commands which overlap under `-j` count once
+    towards the time not attributable to jknit.
+    '''
+
+    result = jknit(directory, ['lone_sleeps.jmd', '-t', '-j',
+                               '2', '-o', 'lone_sleeps.md'])
+    report: Dict[str, float] = {}
+    for line in result.stdout.splitlines():
+        key, _, value = line.partition(':')
+        if value.strip():
+            try:
+                report[key] = float(value)
+            except ValueError:
+                pass
+
+    total: float = report['Total us']
+    jknit_us: float = report['JKnit-attributable us']
+    other_us: float = report['Non-JKnit us']
+    assert 0 <= jknit_us <= total, result.stdout
+    assert 0.3e6 <= other_us <= total, result.stdout
+    assert 0 <= report['Percent JKnit-attributable'] <= 100, \
+        result.stdout
+
+
+def started_order(directory: str) -> List[str]:
+    '''
+    Knits `start_order.jmd` with `-j 2`, returning the chunks
+    in the order they started.
+    '''
+
+    order: str = os.path.join(directory, 'order.txt')
+    if os.path.exists(order):
+        os.remove(order)
+    jknit(directory, ['start_order.jmd', '-j', '2', '-o',
+                      'start_order.md'])
+    with open(order) as f:
+        return f.read().split()
+
+
+def start_order(directory: str) -> None:
+    '''
+    Chunks waiting for a worker start in document order until
+    their timings are known, then longest first, and `--plan`
+    predicts the same order.
+    '''
+
+    # The first two start at once, in either order
+    first: List[str] = started_order(directory)
+    assert first[2:] == ['L3', 'L4'], first
+
+    second: List[str] = started_order(directory)
+    assert second[2:] == ['L4', 'L3'], second
+
+    plan = jknit(directory, ['start_order.jmd', '-j', '2',
+                             '--plan'])
+    planned: List[str] = [
+        line.split('echo ')[1].split()[0]
+        for line in plan.stdout.splitlines() if 'echo ' in line]
+    assert planned[2:] == second[2:], plan.stdout
+    assert sorted(planned[:2]) == ['L1', 'L2'], plan.stdout
+
+
+def sequential_order(directory: str) -> None:
+    '''
+    With `-j 1`, lone chunks run before the sessions after
+    them, and after the sessions before them.
+    '''
+
+    jknit(directory, ['sequential_order.jmd', '-o',
+                      'sequential_order.md'])
+    with open(os.path.join(directory, 'order.txt')) as f:
+        order: List[str] = f.read().split()
+    assert order == ['L1', 'S', 'L2'], order
+
+
+def history(directory: str) -> None:
+    '''
+    Runs saving their timings at once all keep them, and
+    timings of chunks not run for months are dropped.
+    '''
+
+    path: str = os.path.join(directory, '.cache', 'jknit',
+                             'history')
+    os.makedirs(os.path.dirname(path))
+    with open(path, 'w') as f:
+        f.write('123abc 0 1000 1\n')
+
+    env: Dict[str, str] = dict(os.environ)
+    env['XDG_CACHE_HOME'] = os.path.join(directory, '.cache')
+    runs: List[subprocess.Popen] = []
+    for i in range(8):
+        with open(os.path.join(directory, f'h{i}.jmd'),
+                  'w') as f:
+            f.write(f'```bash*\necho {i}\n```\n')
+        runs.append(subprocess.Popen(
+            ['jknit', f'h{i}.jmd', '-o', f'h{i}.md'],
+            cwd=directory, env=env,
+            stdout=subprocess.DEVNULL))
+    for run in runs:
+        assert run.wait(timeout=120) == 0, 'jknit failed'
+
+    with open(path) as f:
+        keys: List[str] = [line.split()[0] for line in f]
+    assert len(keys) == 8, keys
+    assert '123abc' not in keys, keys
+
+
+def fork_server(directory: str) -> None:
+    '''
+    Lone chunks run in forks of their builder's server, with
+    its modules loaded, and several servers serve them at once
+    under `-j`.
+    '''
+
+    start: float = time.perf_counter()
+    jknit(directory, ['fork_server.jmd', '-j', '2', '-o',
+                      'fork_server.md'])
+    elapsed: float = time.perf_counter() - start
+    expect(directory, 'fork_server.md')
+    assert elapsed < 0.9, f'took {elapsed:.2f} s'
+
+
+def include(directory: str) -> None:
+    '''
+    Included files join the includer's sessions, however many
+    times they are included, and circular includes are skipped
+    with a warning.
+    '''
+
+    result = jknit(directory, ['include.jmd', '-o',
+                               'include.md'])
+    expect(directory, 'include.md')
+    assert 'Circular include' in result.stderr, result.stderr
+
+
+def limits(directory: str) -> None:
+    '''
+    A `max=` too large for a semaphore to count is an invalid
+    attribute, not a crash.
+    '''
+
+    with open(os.path.join(directory, 'limits.jmd'), 'w') as f:
+        f.write('```settings\n'
+                'big bash "echo CHUNK_BREAK" sh '
+                'max=9223372036854775808\n```\n')
+    result = jknit(directory, ['limits.jmd', '-e', '-o',
+                               'limits.md'], code=2)
+    assert 'Invalid builder attribute' in result.stderr, \
+        result.stderr
+
+
+def so_host(directory: str) -> None:
+    '''
+    Shared object chunks run in the host's forks when lone, and
+    in the host run directly when combined, with their static
+    destructors run either way.
+    '''
+
+    jknit(directory, ['so_host.jmd', '-o', 'so_host.md'])
+    expect(directory, 'so_host.md')
+
+
+def bench(directory: str) -> None:
+    '''
+    `@bench=N` adds a table of `N` timed runs, and a count too
+    large to hold is reported with its line.
+    '''
+
+    result = jknit(directory, ['bench.jmd', '-o', 'bench.md'])
+    assert 'Invalid @bench count on line 3' in result.stderr, \
+        result.stderr
+    with open(os.path.join(directory, 'bench.md')) as f:
+        knit: str = f.read()
+    assert knit.count('*Over 2 runs after a warmup*') == 1, knit
+
+    jknit(directory, ['bench.jmd', '-e', '-o', 'bench.md'],
+          code=2)
+
+
+def inline_spans(directory: str) -> None:
+    '''
+    Inline values are evaluated in their sessions, including
+    after plain code which starts with `{` on the same line.
+    '''
+
+    jknit(directory, ['inline_spans.jmd', '-o',
+                      'inline_spans.md'])
+    expect(directory, 'inline_spans.md')
+
+
+def side_files(directory: str) -> None:
+    '''
+    With `--externalize`, long blocks are written to side files
+    named for their contents, and those the target no longer
+    uses are removed once it is knit again.
+    '''
+
+    args: List[str] = ['side_files.jmd', '--externalize', '3',
+                       '-o', 'side_files.tex']
+    blocks: str = os.path.join(directory, 'side_files-blocks')
+    jknit(directory, args)
+    expect(directory, 'side_files.tex')
+    first: List[str] = sorted(os.listdir(blocks))
+    assert len(first) == 2, first
+
+    with open(os.path.join(blocks, 'notes.txt'), 'w') as f:
+        f.write('Not a block\n')
+    path: str = os.path.join(directory, 'side_files.jmd')
+    with open(path) as f:
+        source: str = f.read()
+    with open(path, 'w') as f:
+        f.write(source.replace('1 2 3 4 5', '1 2 3 4'))
+
+    jknit(directory, args)
+    second: List[str] = sorted(os.listdir(blocks))
+    assert 'notes.txt' in second, second
+    second.remove('notes.txt')
+    assert len(second) == 2, second
+    assert not set(first) & set(second), (first, second)
+
+
+def log(directory: str) -> None:
+    '''
+    With `-l`, each log line is JSON with a microsecond
+    timestamp, and payloads over 4 KB are logged as their start,
+    size and FNV-1a hash.
+    '''
+
+    jknit(directory, ['log.jmd', '-l', '-o', 'log.md'])
+    with open(os.path.join(directory, 'jknit.log')) as f:
+        lines: List[str] = f.read().splitlines()
+
+    payload: bytes = b'x' * 5000 + b'\n'
+    fnv: int = 0xcbf29ce484222325
+    for byte in payload:
+        fnv = ((fnv ^ byte) * 0x100000001b3) % 2**64
+
+    logged: List[dict] = []
+    for line in lines:
+        assert re.match(r'\{"ts":\d+\.\d{6},', line), line
+        event: dict = json.loads(line)
+        if isinstance(event.get('text'), dict):
+            logged.append(event['text'])
+
+    assert logged == [{'head': 'x' * 4096, 'bytes': 5001,
+                       'fnv': f'{fnv:016x}'}], logged
+
+
+CASES: Dict[str, Callable[[str], None]] = {
+    'multi target': multi_target,
+    'multi target error': multi_target_error,
+    'timer': timer,
+    'start order': start_order,
+    'sequential order': sequential_order,
+    'history': history,
+    'fork server': fork_server,
+    'include': include,
+    'limits': limits,
+    'so host': so_host,
+    'bench': bench,
+    'inline spans': inline_spans,
+    'side files': side_files,
+    'log': log,
+}
+
+
+def main() -> int:
+    '''
+    Runs every case from its own copy of `features/`.
+    '''
+
+    failures: List[str] = []
+
+    for name, case in CASES.items():
+        with tempfile.TemporaryDirectory() as directory:
+            directory = os.path.join(directory, 'features')
+            shutil.copytree(FEATURES, directory)
+
+            try:
+                case(directory)
+                print(f'{name:>24} ok')
+            except (AssertionError, KeyError, OSError,
+                    ValueError,
+                    subprocess.SubprocessError) as e:
+                print(f'{name:>24} FAILED')
+                failures.append(f'{name}: {e}')
+
+    for failure in failures:
+        print(f'FAILED: {failure}', file=sys.stderr)
+
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
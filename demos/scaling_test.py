@@ -0,0 +1,195 @@
+#!/usr/bin/python3
+
+'''
+Scaling regression suite for JKnit's parser and renderers.
+Generates adversarial documents of growing size, knits each to
+both `md` and `tex`, and fails if runtime or memory grow much
+faster than the input does.
+Jordan Dehmel, 2023-present
+'''
+
+import os
+import subprocess
+import sys
+import tempfile
+from typing import Callable, Dict, List, Tuple
+
+# Input sizes, as multiples of each generator's base unit
+SIZES: List[int] = [1, 2, 4, 8]
+
+# Allowed slowdown beyond linear between the smallest and
+# largest sizes
+TIME_SLACK: float = 3.0
+
+# Runs faster than this are dominated by process startup
+MIN_SECONDS: float = 0.05
+
+# Allowed growth of peak RSS per byte of input growth, plus a
+# fixed allowance
+RSS_BYTES_PER_INPUT_BYTE: float = 64.0
+RSS_ALLOWANCE_KB: int = 16 * 1024
+
+
+def long_line(n: int) -> str:
+    '''
+    One very long line full of inline markup, including
+    unterminated spans.
+    '''
+
+    unit: str = ('word *it* **bold** `code` $x^2$ 50% #tag ~ '
+                 '[link](http://a.b/c%20d#e) \\_ ')
+    return unit * (n * 10000) + ' $ unterminated ` also\n'
+
+
+def deep_nesting(n: int) -> str:
+    '''
+    Deeply nested lists, quotes and headers on single lines,
+    plus a deeply indented list.
+    '''
+
+    depth: int = n * 4000
+    out: str = '- ' * depth + 'item\n\n'
+    out += '>' * depth + ' quote\n\n'
+    out += '# ' * depth + 'header\n\n'
+    out += ''.join(' ' * i + '- item\n'
+                   for i in range(depth // 10))
+    return out
+
+
+def many_lines(n: int) -> str:
+    '''
+    Many ordinary lines of mixed markdown.
+    '''
+
+    unit: str = ('# Header\n'
+                 'Some *text* with `code` and $math$.\n'
+                 '- A list\n'
+                 '    1. Nested\n'
+                 '> A quote\n'
+                 '[A link](http://example.com)\n'
+                 '\n')
+    return unit * (n * 10000)
+
+
+def many_fences(n: int) -> str:
+    '''
+    Thousands of combined and hidden code chunks.
+    '''
+
+    out: str = ''
+    for i in range(n * 1000):
+        out += f'Chunk {i}\n\n```bash\necho {i}\n```\n\n'
+        out += f'```bash^~\nX={i}\n```\n\n'
+    return out
+
+
+GENERATORS: Dict[str, Callable[[int], str]] = {
+    'long line': long_line,
+    'deep nesting': deep_nesting,
+    'many lines': many_lines,
+    'many fences': many_fences,
+}
+
+
+# Runs jknit from a fresh, small process and reports its elapsed
+# time and peak RSS. Peak RSS survives `exec`, so forking jknit
+# directly from this (large) process would hide its own usage.
+MEASURE: str = '''
+import os, sys, time
+start = time.perf_counter()
+pid = os.posix_spawnp(sys.argv[1], sys.argv[1:], os.environ)
+_, status, usage = os.wait4(pid, 0)
+print(os.waitstatus_to_exitcode(status),
+      time.perf_counter() - start, usage.ru_maxrss)
+'''
+
+
+def knit(source: str, target: str) -> Tuple[float, int]:
+    '''
+    Knits the given file, returning the elapsed seconds and the
+    peak RSS of jknit in KB.
+    '''
+
+    result: List[str] = subprocess.run(
+        [sys.executable, '-c', MEASURE,
+         'jknit', source, '-o', target],
+        check=True, stdout=subprocess.PIPE,
+        text=True).stdout.split()
+
+    assert result[0] == '0', \
+        f'jknit exited with {result[0]} on {source}'
+    return float(result[1]), int(result[2])
+
+
+def check(label: str,
+          results: List[Tuple[int, float, int]]) -> List[str]:
+    '''
+    Compares the smallest and largest runs of a generator,
+    returning a description of each way they scaled badly.
+    '''
+
+    failures: List[str] = []
+    (small_bytes, small_s, small_kb) = results[0]
+    (big_bytes, big_s, big_kb) = results[-1]
+    growth: float = big_bytes / small_bytes
+
+    if (max(big_s, MIN_SECONDS) >
+            growth * TIME_SLACK * max(small_s, MIN_SECONDS)):
+        failures.append(f'{label}: {growth:.1f}x input took '
+                        f'{big_s / small_s:.1f}x time')
+
+    allowed_kb: float = (RSS_ALLOWANCE_KB +
+                         RSS_BYTES_PER_INPUT_BYTE *
+                         (big_bytes - small_bytes) / 1024)
+    if big_kb - small_kb > allowed_kb:
+        failures.append(f'{label}: peak RSS grew by '
+                        f'{big_kb - small_kb} KB')
+
+    return failures
+
+
+def main() -> int:
+    '''
+    Runs every generator at every size for both targets.
+    '''
+
+    failures: List[str] = []
+
+    with tempfile.TemporaryDirectory() as directory:
+        for name, generator in GENERATORS.items():
+            for extension in ['md', 'tex']:
+                results: List[Tuple[int, float, int]] = []
+
+                for size in SIZES:
+                    source: str = os.path.join(
+                        directory, 'in.jmd')
+                    target: str = os.path.join(
+                        directory, 'out.' + extension)
+                    text: str = generator(size)
+                    with open(source, 'w') as f:
+                        f.write(text)
+
+                    try:
+                        elapsed, rss = knit(source, target)
+                    except AssertionError as e:
+                        failures.append(
+                            f'{name} ({extension}): {e}')
+                        break
+
+                    results.append((len(text), elapsed, rss))
+                    print(f'{name:>13} {extension:>3} '
+                          f'{len(text):>10} B '
+                          f'{elapsed:>8.3f} s {rss:>8} KB')
+
+                if len(results) == len(SIZES):
+                    failures += check(f'{name} ({extension})',
+                                      results)
+
+    for failure in failures:
+        print(f'FAILED: {failure}', file=sys.stderr)
+
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,14 +1,100 @@
 #include "engine.hpp"
+#include "scan.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <charconv>
+#include <cmath>
 #include <chrono>
+#include <csignal>
 #include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <fcntl.h>
 #include <filesystem>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <memory.h>
+#include <mutex>
+#include <optional>
+#include <poll.h>
 #include <queue>
+#include <semaphore>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+// Every running child, by pid, or by negated process group for
+// those put in their own. Slots are claimed and freed without
+// locks, as a signal handler reads them.
+static std::atomic<pid_t> running[1024];
+static std::atomic<bool> interrupted = false;
+static_assert(std::atomic<pid_t>::is_always_lock_free);
+
+void interrupt_commands()
+{
+    interrupted = true;
+    for (auto &slot : running)
+    {
+        const pid_t pid = slot.load();
+        if (pid != 0)
+        {
+            kill(pid, SIGKILL);
+        }
+    }
+}
+
+// Note a child as running, killing it at once if interrupted
+static void track_child(const pid_t _pid)
+{
+    for (auto &slot : running)
+    {
+        pid_t empty = 0;
+        if (slot.compare_exchange_strong(empty, _pid))
+        {
+            break;
+        }
+    }
+    if (interrupted)
+    {
+        kill(_pid, SIGKILL);
+    }
+}
+
+// Wait for a child and forget it, before its pid may be reused
+static pid_t reap_child(const pid_t _pid,
+                        int *_status = nullptr,
+                        struct rusage *_usage = nullptr)
+{
+    pid_t out;
+    while ((out = wait4(_pid, _status, 0, _usage)) < 0 &&
+           errno == EINTR)
+    {
+    }
+    for (auto &slot : running)
+    {
+        pid_t expected = _pid;
+        pid_t group = -_pid;
+        if (slot.compare_exchange_strong(expected, 0) ||
+            slot.compare_exchange_strong(group, 0))
+        {
+            break;
+        }
+    }
+    return out;
+}
 
 // Strip quotes off
 std::string strip_string(const std::string &_from)
@@ -67,8 +153,22 @@ std::string strip_header(const std::string &_from)
     return out;
 }
 
-// Takes in a header, including leading backticks
-void parse_header(const std::string &_header, Chunk &_into)
+// Parse a whole, non-negative number, rejecting anything else,
+// including numbers too large to hold
+static bool parse_count(const std::string &_text,
+                        uint64_t &_into)
+{
+    const auto end = _text.data() + _text.size();
+    const auto result =
+        std::from_chars(_text.data(), end, _into);
+    return result.ec == std::errc() && result.ptr == end &&
+           !_text.empty();
+}
+
+// Takes in a header, including leading backticks. Returns
+// false if its `@bench` count is too large to hold, in which
+// case the chunk is not benchmarked.
+bool parse_header(const std::string &_header, Chunk &_into)
 {
     // Parse settings from the given header
     /*
@@ -79,352 +179,2542 @@ void parse_header(const std::string &_header, Chunk &_into)
      `~`      | Hide code
     */
 
-    if (_header.find('*') != std::string::npos)
+    // `@bench=N` runs a lone chunk N more times, timing each
+    std::string header = _header;
+    bool valid = true;
+    const auto bench_at = header.find("@bench=");
+    if (bench_at != std::string::npos)
+    {
+        uint64_t end = bench_at + 7;
+        while (end < header.size() && std::isdigit(header[end]))
+        {
+            ++end;
+        }
+
+        const auto count =
+            header.substr(bench_at + 7, end - bench_at - 7);
+        _into.bench = 0;
+        if (!count.empty() && !parse_count(count, _into.bench))
+        {
+            valid = false;
+        }
+        _into.combine = false;
+        header.erase(bench_at, end - bench_at);
+    }
+
+    if (header.find('*') != std::string::npos)
     {
         _into.combine = false;
     }
 
-    if (_header.find('^') != std::string::npos)
+    if (header.find('^') != std::string::npos)
     {
         _into.show_output = false;
     }
 
-    if (_header.find('~') != std::string::npos)
+    if (header.find('~') != std::string::npos)
     {
         _into.show_code = false;
     }
 
     // Trim tailing markers
-    _into.type = strip_header(_header);
+    _into.type = strip_header(header);
+    return valid;
 }
 
-// Return a new chunk containing the output of the given code.
-Chunk Engine::run_code_chunk(const Builder &_builder,
-                             const Chunk &_code)
+// An inline `{lang} expr` span within a line of text. `end` is
+// one past its closing backtick.
+struct InlineSpan
 {
-    // Save as file
-    Chunk out;
-    std::string command;
-    const std::string input_file =
-        magic_number + "_jknit." + _builder.extension;
-    std::ofstream f(input_file);
+    uint64_t begin, end;
+    std::string lang, expr;
+};
 
-    if (!f.is_open())
+static std::list<InlineSpan> inline_spans(
+    const std::string &_line)
+{
+    std::list<InlineSpan> out;
+    uint64_t at = 0;
+    while ((at = _line.find("`{", at)) != std::string::npos)
     {
-        if (settings.all_errors)
+        const auto close = _line.find('}', at + 2);
+        const auto end = _line.find('`', at + 1);
+        if (close == std::string::npos ||
+            end == std::string::npos)
         {
-            throw std::runtime_error(
-                "Could not write temp files; Check "
-                "permissions.");
+            break;
         }
-        else
+        else if (end < close)
         {
-            std::cerr << "WARNING: "
-                      << "Could not write temp files; "
-                      << "Check permissions.\n";
-            return out;
+            // Plain code which happens to start with `{`: Skip
+            // it, as markdown would, and keep looking
+            at = end + 1;
+            continue;
         }
-    }
 
-    if (!settings.log)
-    {
-        for (const auto &l : _code.lines)
+        InlineSpan span;
+        span.begin = at;
+        span.end = end + 1;
+        span.lang = _line.substr(at + 2, close - at - 2);
+        span.expr = _line.substr(close + 1, end - close - 1);
+        span.expr.erase(0, span.expr.find_first_not_of(' '));
+        span.expr.erase(span.expr.find_last_not_of(' ') + 1);
+        for (auto &c : span.lang)
         {
-            f << l << '\n';
+            c = toupper(c);
         }
+        out.push_back(span);
+        at = end + 1;
     }
-    else
+    return out;
+}
+
+// The level of the markdown heading on the given line, setting
+// `_title` to its text, or 0 if it is not a heading
+static uint64_t heading_level(const std::string &_line,
+                              std::string &_title)
+{
+    const auto hashes = _line.find_first_not_of(' ');
+    if (hashes == std::string::npos || _line[hashes] != '#')
     {
-        log << "Executing:\n```" << _code.type << "\n";
-        for (const auto &l : _code.lines)
-        {
-            log << l << '\n';
-            f << l << '\n';
-        }
-        log << "```\n";
+        return 0;
     }
-    f.close();
 
-    // Construct command
-    if (command.find("%") == std::string::npos)
+    const auto after = _line.find_first_not_of('#', hashes);
+    if (after != std::string::npos && _line[after] != ' ')
     {
-        command = _builder.commandPath + " " + input_file;
+        return 0;
     }
-    else
+    else if (after == std::string::npos)
     {
-        while (command.find("%") != std::string::npos)
-        {
-            command.replace(command.find("%"), 1, input_file);
-        }
+        _title.clear();
+        return _line.size() - hashes;
     }
 
-    // Run
-    try
+    _title = _line.substr(after);
+    _title.erase(0, _title.find_first_not_of(' '));
+    _title.erase(_title.find_last_not_of(' ') + 1);
+    return after - hashes;
+}
+
+// Split raw command output into an output chunk, one line per
+// line of text
+Chunk output_chunk(const std::string &_text)
+{
+    Chunk out;
+    out.combine = false;
+    out.show_code = out.show_output = true;
+    out.type = "OUTPUT";
+
+    uint64_t begin = 0, end;
+    while (begin < _text.size())
     {
-        out = run_and_get_output(command);
+        end = _text.find('\n', begin);
+        if (end == std::string::npos)
+        {
+            end = _text.size();
+        }
 
-        // Erase temp file
-        std::filesystem::remove_all(input_file);
+        out.lines.push_back(_text.substr(begin, end - begin));
+        begin = end + 1;
     }
-    catch (...)
+
+    return out;
+}
+
+// Summarize timed runs as a BENCH chunk. Its lines are the rows
+// of a table, with cells separated by tabs, and `pos_in_type`
+// is the number of runs.
+Chunk bench_chunk(const std::vector<Usage> &_runs)
+{
+    Chunk out;
+    out.combine = false;
+    out.type = "BENCH";
+    out.pos_in_type = _runs.size();
+    out.lines.push_back("\tMin\tMedian\tp95\tStd. dev.");
+
+    using Metric = std::function<double(const Usage &)>;
+    const std::list<std::pair<std::string, Metric>> metrics = {
+        {"Wall (ms)",
+         [](const Usage &u) { return u.wall_us / 1000.0; }},
+        {"User (ms)",
+         [](const Usage &u) { return u.user_us / 1000.0; }},
+        {"System (ms)",
+         [](const Usage &u) { return u.sys_us / 1000.0; }},
+        {"Max RSS (KB)",
+         [](const Usage &u) { return (double)u.max_rss_kb; }},
+    };
+
+    for (const auto &[name, get] : metrics)
     {
-        // Erase temp file
-        // std::filesystem::remove_all(input_file);
+        std::vector<double> values;
+        double mean = 0.0, variance = 0.0;
+        for (const auto &run : _runs)
+        {
+            values.push_back(get(run));
+            mean += values.back() / _runs.size();
+        }
+        std::sort(values.begin(), values.end());
 
-        if (settings.all_errors)
+        for (const auto &v : values)
         {
-            throw;
+            variance += (v - mean) * (v - mean);
         }
-        else
+        if (values.size() > 1)
         {
-            std::cerr << "WARNING: "
-                      << "Failed to fetch output of command '"
-                      << command << "'\n";
-            out.lines.clear();
+            variance /= values.size() - 1;
         }
+
+        // Nearest-rank percentiles
+        const auto rank = [&](const double _p) {
+            return values[std::ceil(_p * values.size()) - 1];
+        };
+
+        std::stringstream row;
+        row << std::fixed << std::setprecision(3) << name
+            << '\t' << values.front() << '\t' << rank(0.5)
+            << '\t' << rank(0.95) << '\t'
+            << std::sqrt(variance);
+        out.lines.push_back(row.str());
     }
 
-    // Output chunk
     return out;
 }
 
-// Breaks a single output chunk into multiple
-std::queue<Chunk> Engine::break_output_chunk(const Chunk &_c)
+// Substitute the source file for `%` and the binary for `@`
+std::string fill_command(const std::string &_template,
+                         const Job &_job)
 {
-    // 'CHUNK_BREAK' on its own line
-    std::queue<Chunk> out;
-    Chunk current_chunk = _c;
-    current_chunk.lines.clear();
-
-    // Iterate over input lines
-    for (const auto &line : _c.lines)
+    std::string out;
+    for (const auto c : _template)
     {
-        if (line == "CHUNK_BREAK")
+        if (c == '%')
         {
-            out.push(current_chunk);
-            current_chunk.lines.clear();
+            out += _job.source;
+        }
+        else if (c == '@')
+        {
+            out += _job.binary;
         }
         else
         {
-            current_chunk.lines.push_back(line);
+            out += c;
         }
     }
-    out.push(current_chunk);
-
     return out;
 }
 
-// Run the given shell command and get its output.
-// SYSTEM DEPENDENT
-Chunk Engine::run_and_get_output(const std::string &_cmd)
+bool Engine::write_source(const Job &_job)
 {
-    const static uint64_t buffer_size = 128;
-    static char buffer[buffer_size];
-    static std::chrono::high_resolution_clock::time_point start,
-        stop;
-    static uint64_t elapsed_us;
+    std::ofstream f(_job.source);
 
-    if (settings.time)
+    if (!f.is_open())
     {
-        start = std::chrono::high_resolution_clock::now();
+        if (settings.all_errors)
+        {
+            throw std::runtime_error(
+                "Could not write temp files; Check "
+                "permissions.");
+        }
+        else
+        {
+            std::cerr << "WARNING: "
+                      << "Could not write temp files; "
+                      << "Check permissions.\n";
+            return false;
+        }
     }
 
-    int result = -1;
-    Chunk out;
-
-    out.combine = false;
-    out.show_code = out.show_output = true;
-    out.type = "OUTPUT";
-
-    memset(buffer, '\0', buffer_size);
+    for (const auto &l : _job.code.lines)
+    {
+        f << l << '\n';
+    }
 
-    if (settings.log)
+    if (logger.enabled(LogLevel::debug))
     {
-        log << "Running w/ cmd `" << _cmd << "`\n";
+        std::string code;
+        for (const auto &l : _job.code.lines)
+        {
+            code += l;
+            code += '\n';
+        }
+        logger.write(LogLevel::debug, "source",
+                     {{"path", _job.source},
+                      {"language", _job.code.type},
+                      {"code", code}});
     }
 
-    FILE *pipe = popen(_cmd.c_str(), "r");
-    if (!pipe)
+    return true;
+}
+
+// Make a private directory, preferring tmpfs and falling back
+// to the usual temp directory
+static std::string make_private_dir()
+{
+    std::list<std::string> bases;
+    if (getenv("XDG_RUNTIME_DIR") != nullptr)
     {
-        throw std::runtime_error("Failed to run command '" +
-                                 _cmd + "'");
+        bases.push_back(getenv("XDG_RUNTIME_DIR"));
     }
+    bases.push_back("/dev/shm");
+    bases.push_back(
+        std::filesystem::temp_directory_path().string());
 
-    try
+    for (const auto &base : bases)
     {
-        while (fgets(buffer, sizeof(buffer), pipe))
+        std::string path = base + "/jknit.XXXXXX";
+        if (mkdtemp(path.data()) != nullptr)
         {
-            out.lines.push_back(buffer);
-            while (!out.lines.back().empty() &&
-                   out.lines.back().back() == '\n')
-            {
-                out.lines.back().pop_back();
-            }
-            memset(buffer, '\0', buffer_size);
+            return path;
         }
     }
-    catch (...)
+
+    throw std::runtime_error(
+        "Failed to create a scratch directory");
+}
+
+void Engine::make_scratch()
+{
+    if (!scratch.empty())
     {
-        pclose(pipe);
-        throw;
+        return;
     }
 
-    result = pclose(pipe);
-    if (result != 0)
+    scratch = make_private_dir();
+    logger.write(LogLevel::info, "scratch",
+                 {{"path", scratch}});
+}
+
+void Engine::finish_job(Job &_job, CommandOutput &_into)
+{
+    std::string command;
+
+    if (_job.source.empty())
     {
-        result = errno;
-        throw std::runtime_error(
-            "Command '" + _cmd +
-            "' had non-zero exit code of " +
-            std::to_string(result) + ".");
+        return;
     }
 
-    if (settings.log)
+    try
+    {
+        if (_job.compiled.valid())
+        {
+            _job.compiled.get();
+        }
+    }
+    catch (...)
     {
-        log << "Yielded output:\n```" << out.type << "\n";
-        for (const auto &line : out.lines)
+        record_job(_job, _into);
+        if (settings.all_errors || interrupted)
         {
-            log << line << '\n';
+            throw;
         }
-        log << "```\n";
+
+        std::cerr << "WARNING: "
+                  << "Failed to compile '" << _job.source
+                  << "'\n";
+        return;
     }
 
-    if (settings.time)
+    // The binary may have come from the artifact cache
+    if (!_job.builder.compileCommand.empty())
     {
-        stop = std::chrono::high_resolution_clock::now();
-        elapsed_us =
-            std::chrono::duration_cast<
-                std::chrono::microseconds>(stop - start)
-                .count();
-        external_us += elapsed_us;
+        command = fill_command(_job.builder.runCommand, _job);
+    }
+    else if (_job.builder.commandPath.find('%') ==
+             std::string::npos)
+    {
+        command = _job.builder.commandPath + " " + _job.source;
+    }
+    else
+    {
+        command = fill_command(_job.builder.commandPath, _job);
+    }
 
-        if (settings.log)
+    // Sessions may have been started while parsing
+    Prewarmed *warm = nullptr;
+    if (_job.code.combine)
+    {
+        const auto found = prewarmed.find(_job.code.type);
+        if (found != prewarmed.end() &&
+            found->second.child.pid >= 0 &&
+            found->second.command == _job.builder.prewarm)
         {
-            log << "Took " << elapsed_us << " us\n";
+            warm = &found->second;
         }
     }
 
-    return out;
-}
-
-Engine::Engine(const Settings &_s)
-{
-    settings = _s;
-    builders["SETTINGS"] = Builder();
+    // Lone chunks may go to the builder's servers
+    bool served =
+        !_job.builder.server.empty() && !_job.code.combine;
+    const auto run = [&]() {
+        if (warm != nullptr)
+        {
+            return feed(*warm, _job);
+        }
+        else if (served)
+        {
+            const auto out = run_in_server(_job);
+            if (out)
+            {
+                return *out;
+            }
+            served = false;
+        }
+        return run_and_get_output(command, &_job);
+    };
 
-    source.open(settings.source);
-    target.open(settings.target);
-    if (settings.log)
+    try
     {
-        log.open("jknit.log");
+        _into = run();
+        _job.took.run_us = _into.usage.wall_us;
 
-        if (log.is_open())
+        // The run above was the warmup
+        for (uint64_t i = 0; i < _job.code.bench; ++i)
         {
-            log << "JKnit engine instantiated at " << time(NULL)
-                << '\n';
+            _into.bench.push_back(run().usage);
         }
-        else if (settings.all_errors)
+        std::filesystem::remove_all(_job.scratch);
+        _job.succeeded = true;
+        record_job(_job, _into);
+    }
+    catch (...)
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(_job.scratch, ec);
+        record_job(_job, _into);
+
+        if (settings.all_errors || interrupted)
         {
-            throw std::runtime_error(
-                "Failed to open log 'jknit.log'");
+            throw;
         }
         else
         {
             std::cerr << "WARNING: "
-                      << "Failed to open log 'jknit.log'\n";
-            settings.log = false;
+                      << "Failed to fetch output of "
+                      << "command '" << command << "'\n";
         }
     }
+}
 
-    if (!source.is_open())
+void Engine::record_job(const Job &_job,
+                        const CommandOutput &_out)
+{
+    std::lock_guard<std::mutex> lock(record_mutex);
+    auto &language = stats.languages[_job.code.type];
+    if (!_job.succeeded)
     {
-        throw std::runtime_error("Failed to open source '" +
-                                 settings.source + "'");
+        ++language.failures;
+        return;
     }
 
-    if (!target.is_open())
+    ++(_job.code.combine ? language.sessions : language.lone);
+    language.output_bytes += _out.text.size();
+}
+
+// A short description of a job for the plan
+static std::string describe(const Job &_job)
+{
+    std::string out = _job.code.type;
+    out += _job.code.combine ? " session" : ": ";
+    if (!_job.code.combine)
     {
-        throw std::runtime_error("Failed to open target '" +
-                                 settings.target + "'");
+        for (const auto &line : _job.code.lines)
+        {
+            if (!line.empty())
+            {
+                out += line.substr(0, 40);
+                break;
+            }
+        }
     }
+    return out;
 }
 
-Engine::~Engine()
+void Engine::print_plan(
+    const std::vector<std::pair<const Job *, int64_t>> &_order)
 {
-    source.close();
-    target.close();
-    if (settings.log)
+    // Greedily give each job to the earliest free worker
+    std::vector<uint64_t> free_at(std::max<uint64_t>(
+        1, std::min<uint64_t>(settings.jobs, _order.size())));
+    uint64_t longest = 0, unknown = 0;
+
+    std::cout << "Worker | Start ms   | Predicted ms | Chunk\n";
+    for (const auto &[job, predicted] : _order)
+    {
+        const auto worker =
+            std::min_element(free_at.begin(), free_at.end());
+        const uint64_t took = predicted < 0 ? 0 : predicted;
+
+        std::cout << std::left << std::setw(7)
+                  << worker - free_at.begin() << "| "
+                  << std::setw(11) << *worker / 1000 << "| "
+                  << std::setw(13)
+                  << (predicted < 0
+                          ? std::string("?")
+                          : std::to_string(took / 1000))
+                  << "| " << describe(*job) << '\n';
+
+        *worker += took;
+        longest = std::max(longest, took);
+        unknown += predicted < 0;
+    }
+
+    std::cout
+        << "\nPredicted wall time: "
+        << *std::max_element(free_at.begin(), free_at.end()) /
+               1000
+        << " ms\n"
+        << "Longest single job:  " << longest / 1000 << " ms\n";
+    if (unknown != 0)
     {
-        log.close();
+        std::cout << unknown << " job(s) have no history, and "
+                  << "are counted as instant\n";
     }
 }
 
-// Load a file, read each line as settings
-void Engine::load_settings_file(const std::string &_filepath)
+// Identifies a job in the history
+static uint64_t job_key(const Job &_job)
 {
-    // Open file
-    std::ifstream f(_filepath);
-    if (!f.is_open())
+    return hash_lines({_job.code.type, _job.builder.commandPath,
+                       _job.builder.compileCommand,
+                       _job.builder.runCommand},
+                      hash_lines(_job.code.lines));
+}
+
+void Engine::start_job(Job &_job, const std::string &_name,
+                       std::list<std::jthread> &_into)
+{
+    if (_job.builder.max_instances != 0)
     {
-        throw std::runtime_error(
-            "Failed to open settings file '" + _filepath + "'");
+        auto &limit = limits[_job.code.type];
+        if (!limit)
+        {
+            limit = std::make_unique<Limit>(
+                _job.builder.max_instances);
+        }
+        _job.limit = limit.get();
     }
 
-    if (settings.log)
+    make_scratch();
+    _job.scratch = scratch + "/" + _name;
+    const auto warm = prewarmed.find(_job.code.type);
+    if (_job.code.combine && warm != prewarmed.end())
     {
-        log << "Loading settings file '" << _filepath << "'\n";
+        _job.scratch = warm->second.scratch;
     }
+    _job.source = _job.scratch + "/jknit." +
+                  _job.builder.extension;
+    _job.binary = _job.scratch + "/jknit.out";
 
-    // Iterate over lines
-    std::string line;
-    while (!f.eof())
+    std::error_code ec;
+    std::filesystem::create_directory(_job.scratch, ec);
+    if (!write_source(_job))
     {
-        getline(f, line);
-        load_settings_line(line);
+        _job.source.clear();
+        return;
+    }
+    else if (_job.builder.compileCommand.empty())
+    {
+        return;
     }
 
-    // Close file
-    f.close();
+    std::promise<void> done;
+    _job.compiled = done.get_future().share();
+    _into.emplace_back(
+        [this, &_job, done = std::move(done)]() mutable {
+            compile_slots->acquire();
+            try
+            {
+                compile(_job);
+                done.set_value();
+            }
+            catch (...)
+            {
+                done.set_exception(std::current_exception());
+            }
+            compile_slots->release();
+        });
 }
 
-void Engine::load_settings_line(const std::string &_line)
+// The artifact cache is pruned to this size, least recently
+// used binaries first
+const static uint64_t ARTIFACT_CACHE_BYTES = 512ull << 20;
+
+// A compiler's `--version` output, or nothing if it cannot be
+// run. This is not one of the run's commands, so it is neither
+// recorded nor reported.
+static std::string probe_version(const std::string &_compiler)
 {
-    std::string name, path, print_call, extension;
-    std::stringstream from_stream(_line);
+    std::string out;
+    FILE *pipe =
+        popen((_compiler + " --version 2>/dev/null").c_str(),
+              "r");
+    if (pipe == nullptr)
+    {
+        return out;
+    }
 
-    // Get name
-    from_stream >> name;
+    char buffer[256];
+    uint64_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+    {
+        out.append(buffer, read);
+    }
+    pclose(pipe);
+    return out;
+}
 
-    // Handle path (may be quote-enclosed)
-    from_stream >> path;
-    if (path[0] == '\'' || path[0] == '"')
+// Remove the least recently used binaries until the cache fits
+static void prune_artifacts(const std::string &_dir)
+{
+    static std::mutex prune_mutex;
+    std::lock_guard<std::mutex> lock(prune_mutex);
+
+    std::vector<std::pair<std::filesystem::file_time_type,
+                          std::filesystem::path>>
+        binaries;
+    uint64_t total = 0;
+    std::error_code ec;
+    for (const auto &entry :
+         std::filesystem::directory_iterator(_dir, ec))
     {
-        std::string word;
-        while (path.back() != path.front())
+        if (entry.is_regular_file(ec))
         {
-            from_stream >> word;
-            path += ' ' + word;
+            total += entry.file_size(ec);
+            binaries.emplace_back(entry.last_write_time(ec),
+                                  entry.path());
         }
-
-        path.erase(0, 1);
-        path.pop_back();
     }
 
-    // Handle print call (may be quote-enclosed)
-    from_stream >> print_call;
-    if (print_call[0] == '\'' || print_call[0] == '"')
+    std::sort(binaries.begin(), binaries.end());
+    for (const auto &[used, path] : binaries)
     {
-        std::string word;
-        while (print_call.back() != print_call.front())
+        if (total <= ARTIFACT_CACHE_BYTES)
         {
-            from_stream >> word;
-            print_call += ' ' + word;
+            break;
+        }
+        const auto size = std::filesystem::file_size(path, ec);
+        if (!ec && std::filesystem::remove(path, ec))
+        {
+            total -= size;
+        }
+    }
+}
+
+std::string Engine::cached_binary(const Job &_job)
+{
+    const auto dir = cache_path("artifacts");
+    if (dir.empty() || !_job.builder.cache)
+    {
+        return "";
+    }
+
+    // The compiler is the first word of the compile command
+    std::stringstream words(_job.builder.compileCommand);
+    std::string compiler, version;
+    words >> compiler;
+    bool known;
+    {
+        std::lock_guard<std::mutex> lock(
+            compiler_versions_mutex);
+        const auto found = compiler_versions.find(compiler);
+        known = found != compiler_versions.end();
+        if (known)
+        {
+            version = found->second;
+        }
+    }
+
+    // Probed without the lock, so that other compilers' jobs
+    // need not wait. Jobs racing on one compiler agree anyway.
+    if (!known)
+    {
+        version = probe_version(compiler);
+        std::lock_guard<std::mutex> lock(
+            compiler_versions_mutex);
+        compiler_versions[compiler] = version;
+    }
+
+    std::stringstream name;
+    name << std::hex
+         << hash_lines({_job.builder.compileCommand,
+                        _job.builder.extension, compiler,
+                        version},
+                       hash_lines(_job.code.lines));
+    return dir + "/" + name.str();
+}
+
+void Engine::compile(Job &_job)
+{
+    const auto cached = cached_binary(_job);
+    std::error_code ec;
+    const bool hit =
+        !cached.empty() && std::filesystem::exists(cached, ec);
+    if (!cached.empty())
+    {
+        logger.write(LogLevel::info, "artifact",
+                     {{"path", cached}, {"hit", hit}});
+        std::lock_guard<std::mutex> lock(record_mutex);
+        ++(hit ? stats.cache_hits : stats.cache_misses);
+    }
+
+    if (hit)
+    {
+        // Marked as recently used, for pruning
+        const auto now =
+            std::filesystem::file_time_type::clock::now();
+        std::filesystem::last_write_time(cached, now, ec);
+        _job.binary = cached;
+        return;
+    }
+
+    const auto command =
+        fill_command(_job.builder.compileCommand, _job);
+    _job.took.compile_us =
+        run_and_get_output(command, &_job).usage.wall_us;
+    if (cached.empty())
+    {
+        return;
+    }
+
+    // Published atomically, as another knit may be storing
+    // the same binary
+    const auto temp =
+        cached + "." + std::to_string(getpid()) + "." +
+        std::filesystem::path(_job.scratch).filename().string();
+    std::filesystem::create_directories(
+        std::filesystem::path(cached).parent_path(), ec);
+    if (std::filesystem::copy_file(_job.binary, temp, ec))
+    {
+        std::filesystem::rename(temp, cached, ec);
+    }
+    std::filesystem::remove(temp, ec);
+    prune_artifacts(
+        std::filesystem::path(cached).parent_path().string());
+}
+
+std::vector<CommandOutput> Engine::run_jobs(
+    std::vector<Job> &_jobs)
+{
+    std::vector<CommandOutput> outputs(_jobs.size());
+
+    // Predict from the history: Longest first, with jobs that
+    // have never run ahead of all others
+    std::vector<int64_t> predicted(_jobs.size(), -1);
+    std::vector<uint64_t> order(_jobs.size());
+    for (uint64_t i = 0; i < _jobs.size(); ++i)
+    {
+        _jobs[i].key = job_key(_jobs[i]);
+        predicted[i] = predict(_jobs[i]);
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](const uint64_t a, const uint64_t b) {
+                         return (uint64_t)predicted[a] >
+                                (uint64_t)predicted[b];
+                     });
+
+    // Only the order of compiles changes for sequential runs
+    std::vector<uint64_t> run_order = order;
+    if (settings.jobs <= 1)
+    {
+        std::sort(run_order.begin(), run_order.end());
+    }
+
+    // Lone chunks which were not held started while parsing,
+    // so before any session: The first few as soon as they were
+    // parsed, and the rest as workers came free
+    if (settings.plan)
+    {
+        std::vector<Started *> lone;
+        std::vector<std::pair<const Job *, int64_t>> plan;
+        for (auto &chunk : started)
+        {
+            lone.push_back(&chunk);
+            if (!chunk.held && chunk.index <= settings.jobs)
+            {
+                plan.emplace_back(&chunk.job, chunk.predicted);
+            }
+        }
+        std::sort(lone.begin(), lone.end(),
+                  [](const Started *_a, const Started *_b) {
+                      return StartsLater()(_b, _a);
+                  });
+        for (const auto *chunk : lone)
+        {
+            if (!chunk->held && chunk->index > settings.jobs)
+            {
+                plan.emplace_back(&chunk->job,
+                                  chunk->predicted);
+            }
+        }
+        for (const auto i : run_order)
+        {
+            plan.emplace_back(&_jobs[i], predicted[i]);
+        }
+        for (const auto *chunk : lone)
+        {
+            if (chunk->held)
+            {
+                plan.emplace_back(&chunk->job,
+                                  chunk->predicted);
+            }
+        }
+        print_plan(plan);
+        return outputs;
+    }
+
+    // Write every source file and start any compiles
+    std::list<std::jthread> compilers;
+    for (const auto i : order)
+    {
+        start_job(_jobs[i], std::to_string(i), compilers);
+    }
+
+    // Run each job once its own compile is done, on up to
+    // `settings.jobs` threads (including this one). Lone
+    // chunks started while parsing share the same slots.
+    std::atomic<uint64_t> next = 0;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    const auto work = [&]() {
+        uint64_t n;
+        while ((n = next++) < run_order.size())
+        {
+            run_slots->acquire();
+            try
+            {
+                finish_job(_jobs[run_order[n]],
+                           outputs[run_order[n]]);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+                next = run_order.size();
+            }
+            run_slots->release();
+        }
+    };
+
+    {
+        std::vector<std::jthread> workers;
+        const uint64_t threads =
+            std::min<uint64_t>(settings.jobs, run_order.size());
+        for (uint64_t i = 1; i < threads; ++i)
+        {
+            workers.emplace_back(work);
+        }
+        work();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
+    for (const auto &job : _jobs)
+    {
+        if (job.succeeded)
+        {
+            history.record(job.key, job.took);
+        }
+    }
+
+    return outputs;
+}
+
+int64_t Engine::predict(const Job &_job)
+{
+    Timing past;
+    if (!history.lookup(_job.key, past))
+    {
+        return -1;
+    }
+    return past.compile_us +
+           past.run_us * (1 + _job.code.bench);
+}
+
+Job Engine::lone_job(const Chunk &_chunk)
+{
+    Job job;
+    if (builders.count(_chunk.type) != 0)
+    {
+        job.builder = builders.at(_chunk.type);
+    }
+    else
+    {
+        // Unknown builder; Attempt to treat as command
+        job.builder.commandPath = _chunk.type;
+        job.builder.extension = "txt";
+    }
+    job.code = _chunk;
+    return job;
+}
+
+void Engine::start_lone(const Chunk &_chunk)
+{
+    {
+        // Stop parsing as soon as any chunk has failed
+        std::lock_guard<std::mutex> lock(started_mutex);
+        if (started_error)
+        {
+            std::rethrow_exception(started_error);
+        }
+    }
+
+    started.emplace_back();
+    auto &lone = started.back();
+    lone.job = lone_job(_chunk);
+    lone.job.key = job_key(lone.job);
+    lone.held = settings.jobs == 1 && session_seen;
+    lone.predicted = predict(lone.job);
+    lone.priority =
+        settings.jobs <= 1 ? 0 : (uint64_t)lone.predicted;
+    lone.index = started.size();
+
+    // Planning only needs to know when it would start
+    if (!lone.held && !settings.plan)
+    {
+        queue_started(lone);
+    }
+}
+
+bool Engine::StartsLater::operator()(const Started *_a,
+                                     const Started *_b) const
+{
+    return _a->priority < _b->priority ||
+           (_a->priority == _b->priority &&
+            _a->index > _b->index);
+}
+
+// Compile a lone chunk and queue it to be run
+void Engine::queue_started(Started &_lone)
+{
+    start_job(_lone.job, "lone" + std::to_string(_lone.index),
+              started_compilers);
+
+    // Given a run slot and a worker at once if one is free,
+    // rather than whichever chunk a worker finds waiting when
+    // it wakes, so that the order is the one `--plan` reports.
+    // Slots are only taken by sessions once parsing is done.
+    std::lock_guard<std::mutex> lock(started_mutex);
+    if (run_slots->try_acquire())
+    {
+        claimed.push(&_lone);
+    }
+    else
+    {
+        unstarted.push(&_lone);
+    }
+    if (started_workers.size() < settings.jobs)
+    {
+        started_workers.emplace_back(
+            [this]() { run_started(); });
+    }
+    started_cv.notify_one();
+}
+
+// Queue the lone chunks held back until sessions had run
+void Engine::release_held()
+{
+    for (auto &lone : started)
+    {
+        if (lone.held && !settings.plan)
+        {
+            queue_started(lone);
+        }
+    }
+}
+
+// The loop of a worker for lone chunks started while parsing.
+// Each chunk it takes holds a run slot, which is handed to the
+// longest chunk still waiting, if any, once it is done.
+void Engine::run_started()
+{
+    while (true)
+    {
+        Started *next;
+        bool failed;
+        {
+            std::unique_lock<std::mutex> lock(started_mutex);
+            started_cv.wait(lock, [this]() {
+                return !claimed.empty() || parsed;
+            });
+            if (claimed.empty())
+            {
+                return;
+            }
+            next = claimed.front();
+            claimed.pop();
+            failed = started_error != nullptr;
+        }
+
+        // After any failure, chunks just give their slots back
+        try
+        {
+            if (!failed)
+            {
+                finish_job(next->job, next->output);
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(started_mutex);
+            if (!started_error)
+            {
+                started_error = std::current_exception();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(started_mutex);
+        if (unstarted.empty() || started_error)
+        {
+            run_slots->release();
+        }
+        else
+        {
+            claimed.push(unstarted.top());
+            unstarted.pop();
+        }
+    }
+}
+
+void Engine::finish_started()
+{
+    {
+        std::lock_guard<std::mutex> lock(started_mutex);
+        parsed = true;
+    }
+    started_cv.notify_all();
+
+    // Joins each thread
+    started_workers.clear();
+    started_compilers.clear();
+}
+
+// Breaks a single command's output into multiple chunks
+std::queue<Chunk> Engine::break_output_chunk(
+    const CommandOutput &_output)
+{
+    std::queue<Chunk> out;
+
+    // Framed output: Segment by the reported byte offsets
+    if (!_output.frames.empty())
+    {
+        uint64_t begin = 0, end;
+        auto prev_time = _output.start;
+        for (const auto &frame : _output.frames)
+        {
+            end = std::min<uint64_t>(frame.bytes,
+                                     _output.text.size());
+            end = std::max(begin, end);
+            out.push(output_chunk(
+                _output.text.substr(begin, end - begin)));
+
+            logger.write(
+                LogLevel::debug, "frame",
+                {{"chunk", out.size()},
+                 {"bytes", end - begin},
+                 {"us", std::chrono::duration_cast<
+                            std::chrono::microseconds>(
+                            frame.at - prev_time)
+                            .count()}});
+
+            begin = end;
+            prev_time = frame.at;
+        }
+        out.push(output_chunk(_output.text.substr(begin)));
+
+        return out;
+    }
+
+    // 'CHUNK_BREAK' on its own line
+    const Chunk all = output_chunk(_output.text);
+    Chunk current_chunk = all;
+    current_chunk.lines.clear();
+
+    // Iterate over input lines
+    for (const auto &line : all.lines)
+    {
+        if (line == "CHUNK_BREAK")
+        {
+            out.push(current_chunk);
+            current_chunk.lines.clear();
+        }
+        else
+        {
+            current_chunk.lines.push_back(line);
+        }
+    }
+    out.push(current_chunk);
+
+    return out;
+}
+
+// Parse a CPU list like "0-3,6"
+static bool parse_cpu_list(const std::string &_list,
+                           cpu_set_t &_into)
+{
+    std::stringstream ranges(_list);
+    std::string range;
+
+    CPU_ZERO(&_into);
+    while (getline(ranges, range, ','))
+    {
+        uint64_t first, last;
+        const auto dash = range.find('-');
+        if (!parse_count(range.substr(0, dash), first))
+        {
+            return false;
+        }
+        last = first;
+        if (dash != std::string::npos &&
+            !parse_count(range.substr(dash + 1), last))
+        {
+            return false;
+        }
+
+        if (last < first || last >= CPU_SETSIZE)
+        {
+            return false;
+        }
+
+        for (auto cpu = first; cpu <= last; ++cpu)
+        {
+            CPU_SET(cpu, &_into);
+        }
+    }
+
+    return CPU_COUNT(&_into) != 0;
+}
+
+bool Engine::job_cpus(const Job &_job, cpu_set_t &_into)
+{
+    if (!_job.builder.cpus.empty())
+    {
+        return parse_cpu_list(_job.builder.cpus, _into);
+    }
+    else if (_job.builder.cores == 0)
+    {
+        return false;
+    }
+
+    // Hand out the CPUs jknit may use round-robin, so that
+    // concurrent children are pinned to different ones
+    cpu_set_t allowed;
+    std::vector<uint64_t> ids;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return false;
+    }
+    for (uint64_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            ids.push_back(cpu);
+        }
+    }
+
+    const auto count =
+        std::min<uint64_t>(_job.builder.cores, ids.size());
+    const auto start = next_cpu.fetch_add(count);
+    CPU_ZERO(&_into);
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        CPU_SET(ids[(start + i) % ids.size()], &_into);
+    }
+    return count != 0;
+}
+
+// The variables a job's commands get on top of jknit's own.
+// Earlier entries win.
+static std::list<std::string> job_environment(const Job &_job)
+{
+    std::list<std::string> out = _job.builder.env;
+    if (_job.builder.threads != 0)
+    {
+        for (const auto &name :
+             {"OMP_NUM_THREADS", "OPENBLAS_NUM_THREADS",
+              "MKL_NUM_THREADS"})
+        {
+            out.push_back(std::string(name) + "=" +
+                          std::to_string(_job.builder.threads));
+        }
+    }
+    out.push_back("JKNIT_SCRATCH=" + _job.scratch);
+    return out;
+}
+
+// jknit's environment, with the given "KEY=VALUE"s replacing
+// any variables of the same names
+static std::vector<std::string> child_environment(
+    const std::list<std::string> &_overrides)
+{
+    std::vector<std::string> out;
+    for (char **var = environ; *var != nullptr; ++var)
+    {
+        const char *eq = strchr(*var, '=');
+        const auto overridden = std::find_if(
+            _overrides.begin(), _overrides.end(),
+            [&](const std::string &o) {
+                return eq != nullptr &&
+                       o.compare(0, eq - *var + 1, *var,
+                                 eq - *var + 1) == 0;
+            });
+        if (overridden == _overrides.end())
+        {
+            out.push_back(*var);
+        }
+    }
+    out.insert(out.end(), _overrides.begin(), _overrides.end());
+    return out;
+}
+
+void Engine::prewarm(const std::string &_lang)
+{
+    if (settings.plan || prewarmed.count(_lang) != 0 ||
+        builders.count(_lang) == 0)
+    {
+        return;
+    }
+
+    const auto &builder = builders.at(_lang);
+    if (builder.prewarm.empty() ||
+        !builder.compileCommand.empty() ||
+        checkpointing(builder))
+    {
+        return;
+    }
+
+    make_scratch();
+    Job job;
+    job.builder = builder;
+    job.scratch = scratch + "/" + _lang;
+    std::error_code ec;
+    std::filesystem::create_directory(job.scratch, ec);
+
+    Prewarmed session;
+    session.command = builder.prewarm;
+    session.scratch = job.scratch;
+    try
+    {
+        session.child = spawn(builder.prewarm, &job, true);
+    }
+    catch (std::exception &e)
+    {
+        // The session will just be run normally
+        std::cerr << "WARNING: " << e.what() << '\n';
+        return;
+    }
+
+    prewarmed[_lang] = session;
+}
+
+// Write a prewarmed session's code to it and wait for it
+CommandOutput Engine::feed(Prewarmed &_session, const Job &_job)
+{
+    std::string code;
+    for (const auto &line : _job.code.lines)
+    {
+        code += line;
+        code += '\n';
+    }
+
+    logger.write(LogLevel::info, "feed",
+                 {{"command", _session.command},
+                  {"bytes", code.size()}});
+
+    // A failed write means the interpreter died, which
+    // collecting it will report
+    uint64_t written = 0;
+    while (written < code.size())
+    {
+        const auto n = write(_session.child.input,
+                             code.data() + written,
+                             code.size() - written);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n <= 0)
+        {
+            break;
+        }
+        written += n;
+    }
+    close(_session.child.input);
+    _session.child.input = -1;
+
+    // Its limits were not applied when it was spawned
+    auto child = _session.child;
+    _session.child.pid = -1;
+    return collect(_session.command, child, nullptr);
+}
+
+// Start `_command` with its stdin and stdout as pipes, and with
+// the environment of `_job`'s commands, pinned to `_cpus` if
+// given. Returns its pid, or -1.
+static pid_t start_server(const std::string &_command,
+                          const Job &_job, FILE *&_requests,
+                          FILE *&_replies, const bool _group,
+                          const cpu_set_t *_cpus)
+{
+    int to_server[2], from_server[2];
+    if (pipe2(to_server, O_CLOEXEC) != 0)
+    {
+        return -1;
+    }
+    else if (pipe2(from_server, O_CLOEXEC) != 0)
+    {
+        close(to_server[0]);
+        close(to_server[1]);
+        return -1;
+    }
+
+    // Everything but the scratch directory, which is per chunk
+    auto overrides = job_environment(_job);
+    overrides.pop_back();
+    auto env_strings = child_environment(overrides);
+    std::vector<char *> env;
+    for (auto &var : env_strings)
+    {
+        env.push_back(var.data());
+    }
+    env.push_back(nullptr);
+
+    const auto pid = fork();
+    if (pid == 0)
+    {
+        // Servers read no terminal, so each gets its own group,
+        // which is killed along with the chunks it forked
+        if (_group)
+        {
+            setpgid(0, 0);
+        }
+        dup2(to_server[0], STDIN_FILENO);
+        dup2(from_server[1], STDOUT_FILENO);
+        if (_cpus != nullptr)
+        {
+            sched_setaffinity(0, sizeof(*_cpus), _cpus);
+        }
+        signal(SIGPIPE, SIG_DFL);
+        execle("/bin/sh", "sh", "-c", _command.c_str(),
+               (char *)NULL, env.data());
+        _exit(127);
+    }
+
+    close(to_server[0]);
+    close(from_server[1]);
+    if (pid < 0)
+    {
+        close(to_server[1]);
+        close(from_server[0]);
+        return -1;
+    }
+    if (_group)
+    {
+        setpgid(pid, pid);
+    }
+    track_child(_group ? -pid : pid);
+
+    _requests = fdopen(to_server[1], "w");
+    _replies = fdopen(from_server[0], "r");
+    return pid;
+}
+
+Server *Engine::take_server(const Job &_job)
+{
+    std::lock_guard<std::mutex> lock(servers_mutex);
+    auto &pool = servers[_job.code.type];
+    Server *idle = nullptr;
+    for (auto &server : pool)
+    {
+        if (server.pid < 0)
+        {
+            return nullptr;
+        }
+        else if (!server.busy)
+        {
+            idle = &server;
+        }
+    }
+    if (idle != nullptr)
+    {
+        idle->busy = true;
+        return idle;
+    }
+
+    // Chunks are forked from the server, so inherit its CPUs
+    auto &server = pool.emplace_back();
+    cpu_set_t cpus;
+    const bool pin = job_cpus(_job, cpus);
+    server.pid = start_server(_job.builder.server, _job,
+                              server.requests, server.replies,
+                              true, pin ? &cpus : nullptr);
+    if (server.pid < 0)
+    {
+        return nullptr;
+    }
+
+    logger.write(LogLevel::info, "server_start",
+                 {{"server", _job.builder.server},
+                  {"language", _job.code.type},
+                  {"pid", server.pid},
+                  {"copies", pool.size()}});
+    server.busy = true;
+    return &server;
+}
+
+// Close a server's pipes and wait for it to exit
+static void stop_server(Server &_server)
+{
+    if (_server.pid < 0)
+    {
+        return;
+    }
+
+    fclose(_server.requests);
+    fclose(_server.replies);
+    reap_child(_server.pid);
+    _server.pid = -1;
+}
+
+std::optional<CommandOutput> Engine::run_in_server(
+    const Job &_job)
+{
+    // Compiled chunks send their binaries instead of sources
+    CommandOutput out;
+    const auto output = _job.scratch + "/stdout";
+    const auto &file = _job.builder.compileCommand.empty()
+                           ? _job.source
+                           : _job.binary;
+    const auto description = _job.builder.server + " < " + file;
+
+    auto *server = take_server(_job);
+    if (server == nullptr)
+    {
+        return std::nullopt;
+    }
+    logger.write(LogLevel::info, "server_run",
+                 {{"server", _job.builder.server},
+                  {"pid", server->pid},
+                  {"file", file}});
+
+    // One request per line, and one reply per request. The
+    // chunk counts towards `max` while the server runs it.
+    if (_job.limit != nullptr)
+    {
+        _job.limit->acquire();
+    }
+    out.start = std::chrono::high_resolution_clock::now();
+    char reply[256];
+    int64_t status;
+    const bool replied =
+        fprintf(server->requests, "%s\t%s\t%s\n", file.c_str(),
+                output.c_str(), _job.scratch.c_str()) >= 0 &&
+        fflush(server->requests) == 0 &&
+        fgets(reply, sizeof(reply), server->replies) &&
+        sscanf(reply, "%" SCNd64 " %" SCNu64 " %" SCNu64
+               " %" SCNu64,
+               &status, &out.usage.max_rss_kb,
+               &out.usage.user_us, &out.usage.sys_us) == 4;
+    if (_job.limit != nullptr)
+    {
+        _job.limit->release();
+    }
+    {
+        std::lock_guard<std::mutex> lock(servers_mutex);
+        server->busy = false;
+        if (!replied)
+        {
+            stop_server(*server);
+        }
+    }
+    if (!replied)
+    {
+        std::cerr << "WARNING: "
+                  << "Server for '" << _job.code.type
+                  << "' exited; Running chunks directly\n";
+        return std::nullopt;
+    }
+    out.usage.wall_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() -
+            out.start)
+            .count();
+
+    std::ifstream f(output, std::ios::binary);
+    out.text.assign(std::istreambuf_iterator<char>(f),
+                    std::istreambuf_iterator<char>());
+    f.close();
+    std::filesystem::remove(output);
+
+    if (status != 0)
+    {
+        throw std::runtime_error(
+            "Command '" + description +
+            "' had non-zero exit code of " +
+            std::to_string(status) + ".");
+    }
+
+    record_output(description, out);
+    return out;
+}
+
+bool Engine::checkpointing(const Builder &_builder) const
+{
+    return settings.watch && !_builder.checkpoint.empty() &&
+           _builder.compileCommand.empty();
+}
+
+// Guards every session's `steps`, as copies are evicted from
+// all sessions against one budget. Declared first, as sessions
+// lock it when destroyed.
+static std::mutex copies_mutex;
+
+// Checkpointed sessions by builder name. Like the fragment
+// cache, these last from one run to the next.
+static std::map<std::string, std::unique_ptr<Checkpointed>>
+    checkpointed;
+static std::mutex checkpointed_mutex;
+
+// Stopped copies are orphans, so init reaps them
+static void kill_copy(pid_t &_copy)
+{
+    if (_copy > 0)
+    {
+        kill(_copy, SIGKILL);
+    }
+    _copy = -1;
+}
+
+Checkpointed::~Checkpointed()
+{
+    stop();
+}
+
+void Checkpointed::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(copies_mutex);
+        for (auto &step : steps)
+        {
+            kill_copy(step.copy);
+        }
+        steps.clear();
+    }
+    kill_copy(active);
+    if (pidfd >= 0)
+    {
+        close(pidfd);
+        pidfd = -1;
+    }
+
+    if (requests != nullptr)
+    {
+        fclose(requests);
+        fclose(replies);
+        requests = replies = nullptr;
+    }
+    if (driver > 0)
+    {
+        reap_child(driver);
+    }
+    driver = -1;
+
+    if (!scratch.empty())
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(scratch, ec);
+        scratch.clear();
+    }
+}
+
+// Make the given interpreter the active one, returning false if
+// it cannot be watched. This must be done before it is sent
+// anything, as a copy is an orphan: Once dead, it is reaped by
+// init at once, and its pid can no longer be opened.
+static bool set_active(Checkpointed &_session, const pid_t _pid)
+{
+    if (_session.pidfd >= 0)
+    {
+        close(_session.pidfd);
+    }
+    // A pid which cannot be opened may already be reused
+    _session.pidfd = syscall(SYS_pidfd_open, _pid, 0);
+    _session.active = _session.pidfd < 0 ? -1 : _pid;
+    return _session.pidfd >= 0;
+}
+
+// Read a line from the driver, or fail if the active
+// interpreter dies first
+static bool read_reply(Checkpointed &_session, char *_into,
+                       const int _size)
+{
+    if (_session.pidfd < 0)
+    {
+        return false;
+    }
+    pollfd fds[2] = {{fileno(_session.replies), POLLIN, 0},
+                     {_session.pidfd, POLLIN, 0}};
+
+    // A resumed copy is no child of jknit's, so is not killed
+    // by `interrupt_commands`
+    while (poll(fds, 2, 100) <= 0)
+    {
+        if (interrupted)
+        {
+            kill(_session.active, SIGKILL);
+            break;
+        }
+    }
+    return (fds[0].revents & POLLIN) != 0 &&
+           fgets(_into, _size, _session.replies) != nullptr;
+}
+
+// Proportional set size, which splits pages shared with other
+// copies between them, in KB
+static uint64_t pss_kb(const pid_t _pid)
+{
+    std::ifstream f("/proc/" + std::to_string(_pid) +
+                    "/smaps_rollup");
+    std::string line;
+
+    // After a header line of the address range
+    while (getline(f, line))
+    {
+        if (line.starts_with("Pss:"))
+        {
+            return std::strtoull(line.c_str() + 4, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+// Continue from the latest copy taken before the given step,
+// leaving everything after it behind
+bool Engine::resume(Checkpointed &_session,
+                    const uint64_t _changed)
+{
+    pid_t copy;
+    uint64_t kept = _changed;
+    {
+        std::lock_guard<std::mutex> lock(copies_mutex);
+        while (kept > 0 && _session.steps[kept - 1].copy < 0)
+        {
+            --kept;
+        }
+        if (kept == 0)
+        {
+            return false;
+        }
+
+        for (auto i = kept; i < _session.steps.size(); ++i)
+        {
+            kill_copy(_session.steps[i].copy);
+        }
+        _session.steps.resize(kept);
+        copy = _session.steps.back().copy;
+        _session.steps.back().copy = -1;
+    }
+
+    // The driver itself must also be reaped
+    kill(_session.active, SIGKILL);
+    if (_session.active == _session.driver)
+    {
+        reap_child(_session.driver);
+        _session.driver = -1;
+    }
+
+    // It leaves a copy of itself behind in turn
+    if (!set_active(_session, copy))
+    {
+        return false;
+    }
+    kill(_session.active, SIGCONT);
+
+    char reply[64];
+    int next;
+    if (!read_reply(_session, reply, sizeof(reply)) ||
+        sscanf(reply, "%d", &next) != 1)
+    {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(copies_mutex);
+        _session.steps.back().copy = next;
+    }
+
+    logger.write(LogLevel::info, "resume",
+                 {{"command", _session.command},
+                  {"step", kept - 1},
+                  {"pid", _session.active}});
+    return true;
+}
+
+// Drop copies of every session until they fit the budget, each
+// time taking the one quickest to rebuild from the copy before
+// it
+void Engine::evict_copies()
+{
+    std::lock_guard<std::mutex> copies_lock(copies_mutex);
+    std::lock_guard<std::mutex> sessions_lock(
+        checkpointed_mutex);
+    while (true)
+    {
+        uint64_t total_kb = 0;
+        uint64_t cheapest_us = UINT64_MAX;
+        Checkpointed::Step *cheapest = nullptr;
+        const Checkpointed *owner = nullptr;
+        for (const auto &[lang, session] : checkpointed)
+        {
+            uint64_t rebuild_us = 0;
+            for (auto &step : session->steps)
+            {
+                rebuild_us += step.us;
+                if (step.copy < 0)
+                {
+                    continue;
+                }
+
+                total_kb += pss_kb(step.copy);
+                if (rebuild_us < cheapest_us)
+                {
+                    cheapest_us = rebuild_us;
+                    cheapest = &step;
+                    owner = session.get();
+                }
+                rebuild_us = 0;
+            }
+        }
+
+        if (cheapest == nullptr ||
+            total_kb <= settings.checkpoint_mb * 1024)
+        {
+            return;
+        }
+
+        logger.write(LogLevel::info, "evict",
+                     {{"command", owner->command},
+                      {"pid", cheapest->copy},
+                      {"total_kb", total_kb}});
+        kill_copy(cheapest->copy);
+    }
+}
+
+std::queue<Chunk> Engine::run_checkpointed(
+    const std::string &_lang,
+    const std::vector<std::list<std::string>> &_chunks)
+{
+    Job job;
+    job.builder = builders.at(_lang);
+    job.code.type = _lang;
+
+    std::unique_lock<std::mutex> lock(checkpointed_mutex);
+    auto &session = checkpointed[_lang];
+    if (!session)
+    {
+        session = std::make_unique<Checkpointed>();
+    }
+    lock.unlock();
+
+    // Each chunk is known by a hash of it and all before it
+    std::vector<uint64_t> hashes;
+    uint64_t hash = hash_lines({job.builder.checkpoint});
+    for (const auto &chunk : _chunks)
+    {
+        hash = hash_lines(chunk, hash);
+        hashes.push_back(hash);
+    }
+
+    // Resume from the latest copy still of use, or else start
+    // a new interpreter. If nothing has changed, nothing runs.
+    uint64_t kept = 0;
+    if (session->command != job.builder.checkpoint)
+    {
+        session->stop();
+    }
+    while (kept < session->steps.size() &&
+           kept < hashes.size() &&
+           session->steps[kept].hash == hashes[kept])
+    {
+        ++kept;
+    }
+    if (session->active >= 0 && kept < session->steps.size() &&
+        !resume(*session, kept))
+    {
+        session->stop();
+    }
+
+    char reply[256];
+    bool failed = false;
+    if (session->active < 0)
+    {
+        session->command = job.builder.checkpoint;
+        session->scratch = make_private_dir();
+
+        // `exec`, so the shell does not report the interpreter
+        // being killed
+        cpu_set_t cpus;
+        const bool pin = job_cpus(job, cpus);
+        session->driver =
+            start_server("exec " + session->command, job,
+                         session->requests, session->replies,
+                         false, pin ? &cpus : nullptr);
+        pid_t reported;
+        if (session->driver < 0 ||
+            !set_active(*session, session->driver) ||
+            !read_reply(*session, reply, sizeof(reply)) ||
+            sscanf(reply, "%d", &reported) != 1 ||
+            !set_active(*session, reported))
+        {
+            session->stop();
+            if (settings.all_errors)
+            {
+                throw std::runtime_error(
+                    "Failed to start '" + session->command +
+                    "'");
+            }
+            std::cerr << "WARNING: " << "Failed to start '"
+                      << session->command << "'\n";
+            failed = true;
+        }
+        else
+        {
+            logger.write(LogLevel::info, "server_start",
+                         {{"server", session->command},
+                          {"language", _lang},
+                          {"pid", session->active}});
+        }
+    }
+
+    job.scratch = session->scratch;
+    const char keep = settings.checkpoint_mb != 0 ? '1' : '0';
+    for (uint64_t i = session->steps.size();
+         i < _chunks.size() && session->active >= 0; ++i)
+    {
+        const auto id = std::to_string(i);
+        job.code.lines = _chunks[i];
+        job.source = job.scratch + "/" + id + "." +
+                     job.builder.extension;
+        const auto output = job.scratch + "/" + id + ".out";
+        const auto description = session->command + " < " +
+                                 job.source;
+        if (!write_source(job))
+        {
+            break;
+        }
+
+        logger.write(LogLevel::info, "server_run",
+                     {{"server", session->command},
+                      {"file", job.source}});
+
+        CommandOutput out;
+        Checkpointed::Step step;
+        int64_t status;
+        out.start = std::chrono::high_resolution_clock::now();
+        if (fprintf(session->requests, "%s\t%s\t%s\t%c\n",
+                    job.source.c_str(), output.c_str(),
+                    job.scratch.c_str(), keep) < 0 ||
+            fflush(session->requests) != 0 ||
+            !read_reply(*session, reply, sizeof(reply)) ||
+            sscanf(reply,
+                   "%" SCNd64 " %d %" SCNu64 " %" SCNu64
+                   " %" SCNu64,
+                   &status, &step.copy, &out.usage.max_rss_kb,
+                   &out.usage.user_us, &out.usage.sys_us) != 5)
+        {
+            session->stop();
+            if (interrupted)
+            {
+                throw std::runtime_error("Interrupted");
+            }
+            else if (settings.all_errors)
+            {
+                throw std::runtime_error(
+                    "Checkpointed session for '" + _lang +
+                    "' exited");
+            }
+            std::cerr << "WARNING: " << "Checkpointed session "
+                      << "for '" << _lang << "' exited\n";
+            failed = true;
+            break;
+        }
+        out.usage.wall_us = step.us =
+            std::chrono::duration_cast<
+                std::chrono::microseconds>(
+                std::chrono::high_resolution_clock::now() -
+                out.start)
+                .count();
+
+        std::ifstream f(output, std::ios::binary);
+        out.text.assign(std::istreambuf_iterator<char>(f),
+                        std::istreambuf_iterator<char>());
+        f.close();
+        record_output(description, out);
+
+        step.hash = hashes[i];
+        step.output = out.text;
+        step.copy = step.copy == 0 ? -1 : step.copy;
+        {
+            std::lock_guard<std::mutex> lock(copies_mutex);
+            session->steps.push_back(step);
+        }
+        evict_copies();
+
+        // The interpreter lives on, as it would in a notebook
+        if (status != 0 && settings.all_errors)
+        {
+            throw std::runtime_error(
+                "Command '" + description +
+                "' had non-zero exit code of " +
+                std::to_string(status) + ".");
+        }
+        else if (status != 0)
+        {
+            std::cerr << "WARNING: " << "Command '"
+                      << description
+                      << "' had non-zero exit code of "
+                      << status << ".\n";
+            failed = true;
+        }
+    }
+
+    std::queue<Chunk> out;
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < _chunks.size(); ++i)
+    {
+        const auto text = i < session->steps.size()
+                              ? session->steps[i].output
+                              : std::string();
+        bytes += text.size();
+        out.push(output_chunk(text));
+    }
+
+    std::lock_guard<std::mutex> stats_lock(record_mutex);
+    auto &language = stats.languages[_lang];
+    ++(failed ? language.failures : language.sessions);
+    language.output_bytes += bytes;
+    return out;
+}
+
+// Log a command's output and count it towards the stats
+void Engine::record_output(const std::string &_cmd,
+                           const CommandOutput &_out)
+{
+    std::chrono::high_resolution_clock::time_point stop;
+    uint64_t elapsed_us;
+
+    logger.write(LogLevel::debug, "output",
+                 {{"command", _cmd}, {"text", _out.text}});
+
+    if (settings.time || settings.metrics)
+    {
+        stop = std::chrono::high_resolution_clock::now();
+        elapsed_us =
+            std::chrono::duration_cast<
+                std::chrono::microseconds>(stop - _out.start)
+                .count();
+        logger.write(LogLevel::info, "timing",
+                     {{"command", _cmd},
+                      {"us", elapsed_us},
+                      {"max_rss_kb", _out.usage.max_rss_kb}});
+
+        std::lock_guard<std::mutex> lock(record_mutex);
+        busy.emplace_back(_out.start, stop);
+
+        ChildStats child;
+        child.command = _cmd;
+        child.us = elapsed_us;
+        child.max_rss_kb = _out.usage.max_rss_kb;
+        child.user_us = _out.usage.user_us;
+        child.sys_us = _out.usage.sys_us;
+        stats.children.push_back(child);
+    }
+}
+
+Child Engine::spawn(const std::string &_cmd, const Job *_job,
+                    const bool _input)
+{
+    Child child;
+    child.start = std::chrono::high_resolution_clock::now();
+    if (interrupted)
+    {
+        throw std::runtime_error("Interrupted");
+    }
+
+    logger.write(LogLevel::info, "run", {{"command", _cmd}});
+
+    // stdout goes to an (unlinked) temp file rather than a pipe
+    // so that the child may report its own position within it
+    // over the framing channel. Both are close-on-exec so that
+    // commands started concurrently do not hold each other's
+    // framing channels open.
+    FILE *out_file = tmpfile();
+    int frame_pipe[2], input_pipe[2] = {-1, -1};
+    if (!out_file)
+    {
+        throw std::runtime_error(
+            "Failed to create output file for command '" +
+            _cmd + "'");
+    }
+    else if (fcntl(fileno(out_file), F_SETFD, FD_CLOEXEC) !=
+                 0 ||
+             pipe2(frame_pipe, O_CLOEXEC) != 0)
+    {
+        fclose(out_file);
+        throw std::runtime_error(
+            "Failed to create framing pipe for command '" +
+            _cmd + "'");
+    }
+    else if (_input && pipe2(input_pipe, O_CLOEXEC) != 0)
+    {
+        fclose(out_file);
+        close(frame_pipe[0]);
+        close(frame_pipe[1]);
+        throw std::runtime_error(
+            "Failed to create input pipe for command '" +
+            _cmd + "'");
+    }
+
+    // Built before forking, as the child may not allocate
+    std::list<std::string> overrides;
+    cpu_set_t cpus;
+    bool pin = false;
+    if (_job != nullptr)
+    {
+        overrides = job_environment(*_job);
+        pin = job_cpus(*_job, cpus);
+    }
+
+    auto env_strings = child_environment(overrides);
+    std::vector<char *> env;
+    for (auto &var : env_strings)
+    {
+        env.push_back(var.data());
+    }
+    env.push_back(nullptr);
+
+    // Held for as long as the child runs
+    if (_job != nullptr && _job->limit != nullptr)
+    {
+        _job->limit->acquire();
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        if (_job != nullptr && _job->limit != nullptr)
+        {
+            _job->limit->release();
+        }
+        fclose(out_file);
+        close(frame_pipe[0]);
+        close(frame_pipe[1]);
+        if (_input)
+        {
+            close(input_pipe[0]);
+            close(input_pipe[1]);
+        }
+        throw std::runtime_error("Failed to run command '" +
+                                 _cmd + "'");
+    }
+    else if (pid == 0)
+    {
+        // Child: stdout to temp file, framing channel on fd 3,
+        // and stdin from the input pipe if there is one
+        const int out_fd =
+            fcntl(fileno(out_file), F_DUPFD, 10);
+        const int frame_fd = fcntl(frame_pipe[1], F_DUPFD, 10);
+        const int input_fd =
+            _input ? fcntl(input_pipe[0], F_DUPFD, 10) : -1;
+        close(fileno(out_file));
+        close(frame_pipe[0]);
+        close(frame_pipe[1]);
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(frame_fd, 3);
+        close(out_fd);
+        close(frame_fd);
+        if (_input)
+        {
+            close(input_pipe[0]);
+            close(input_pipe[1]);
+            dup2(input_fd, STDIN_FILENO);
+            close(input_fd);
+        }
+
+        if (pin)
+        {
+            sched_setaffinity(0, sizeof(cpus), &cpus);
+        }
+
+        // Ignored by jknit itself, but not by its commands
+        signal(SIGPIPE, SIG_DFL);
+        execle("/bin/sh", "sh", "-c", _cmd.c_str(),
+               (char *)NULL, env.data());
+        _exit(127);
+    }
+
+    track_child(pid);
+    close(frame_pipe[1]);
+    if (_input)
+    {
+        close(input_pipe[0]);
+        child.input = input_pipe[1];
+    }
+    child.pid = pid;
+    child.out_file = out_file;
+    child.frames = frame_pipe[0];
+    return child;
+}
+
+CommandOutput Engine::run_and_get_output(
+    const std::string &_cmd, const Job *_job)
+{
+    auto child = spawn(_cmd, _job);
+    return collect(_cmd, child, _job);
+}
+
+CommandOutput Engine::collect(const std::string &_cmd,
+                              Child &_child, const Job *_job)
+{
+    CommandOutput out;
+    out.start = _child.start;
+
+    // Read framing records until every writer is gone. Each
+    // record is the child's stdout position in decimal,
+    // terminated by a newline.
+    char buffer[128];
+    std::string pending;
+    ssize_t n;
+    bool malformed = false;
+    pollfd frames = {_child.frames, POLLIN, 0};
+    while (true)
+    {
+        // Once interrupted, the killed command's own children
+        // may still hold the channel open, so stop waiting
+        const int ready = poll(&frames, 1, 100);
+        if (ready <= 0)
+        {
+            if (interrupted)
+            {
+                break;
+            }
+            continue;
+        }
+
+        n = read(_child.frames, buffer, sizeof(buffer));
+        if (n == 0)
+        {
+            break;
+        }
+        else if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        const auto at =
+            std::chrono::high_resolution_clock::now();
+        pending.append(buffer, n);
+
+        uint64_t newline;
+        while ((newline = pending.find('\n')) !=
+               std::string::npos)
+        {
+            Frame frame;
+            frame.at = at;
+            const auto result =
+                std::from_chars(pending.data(),
+                                pending.data() + newline,
+                                frame.bytes);
+            if (result.ec == std::errc() &&
+                result.ptr == pending.data() + newline)
+            {
+                out.frames.push_back(frame);
+            }
+            else
+            {
+                malformed = true;
+            }
+            pending.erase(0, newline + 1);
+        }
+    }
+    close(_child.frames);
+
+    int status = 0;
+    struct rusage usage;
+    reap_child(_child.pid, &status, &usage);
+    if (_job != nullptr && _job->limit != nullptr)
+    {
+        _job->limit->release();
+    }
+    out.usage.wall_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() -
+            out.start)
+            .count();
+    out.usage.user_us = usage.ru_utime.tv_sec * 1000000 +
+                        usage.ru_utime.tv_usec;
+    out.usage.sys_us = usage.ru_stime.tv_sec * 1000000 +
+                       usage.ru_stime.tv_usec;
+    out.usage.max_rss_kb = usage.ru_maxrss;
+
+    // Collect stdout
+    rewind(_child.out_file);
+    while ((n = fread(buffer, 1, sizeof(buffer),
+                      _child.out_file)) > 0)
+    {
+        out.text.append(buffer, n);
+    }
+    fclose(_child.out_file);
+
+    if (interrupted)
+    {
+        throw std::runtime_error("Interrupted");
+    }
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        throw std::runtime_error(
+            "Command '" + _cmd +
+            "' had non-zero exit code of " +
+            std::to_string(WIFEXITED(status)
+                               ? WEXITSTATUS(status)
+                               : 128 + WTERMSIG(status)) +
+            ".");
+    }
+    else if (malformed)
+    {
+        if (settings.all_errors)
+        {
+            throw std::runtime_error(
+                "Command '" + _cmd +
+                "' wrote malformed framing records");
+        }
+        std::cerr << "WARNING: "
+                  << "Command '" << _cmd
+                  << "' wrote malformed framing records\n";
+    }
+
+    record_output(_cmd, out);
+    return out;
+}
+
+Engine::Engine(const Settings &_s)
+{
+    settings = _s;
+    builders["SETTINGS"] = Builder();
+    compile_slots = std::make_unique<Limit>(
+        std::max(1u, std::thread::hardware_concurrency()));
+    run_slots = std::make_unique<Limit>(std::clamp<uint64_t>(
+        settings.jobs, 1, Limit::max()));
+
+    source.open(settings.source);
+    add_dependency(settings.source);
+    temp_target = settings.target + "." +
+                  std::to_string(getpid()) + ".tmp";
+    target.open(temp_target);
+    if (settings.log)
+    {
+        if (logger.open(settings.log_file, settings.log_level))
+        {
+            logger.write(LogLevel::info, "start",
+                         {{"source", settings.source},
+                          {"target", settings.target}});
+        }
+        else if (settings.all_errors)
+        {
+            throw std::runtime_error("Failed to open log '" +
+                                     settings.log_file + "'");
+        }
+        else
+        {
+            std::cerr << "WARNING: " << "Failed to open log '"
+                      << settings.log_file << "'\n";
+            settings.log = false;
+        }
+    }
+
+    if (!source.is_open())
+    {
+        throw std::runtime_error("Failed to open source '" +
+                                 settings.source + "'");
+    }
+
+    if (!target.is_open())
+    {
+        throw std::runtime_error("Failed to open target '" +
+                                 settings.target + "'");
+    }
+}
+
+Engine::~Engine()
+{
+    // Left running if parsing or running failed
+    finish_started();
+
+    // Sessions which never ran get empty input
+    for (auto &[lang, session] : prewarmed)
+    {
+        if (session.child.pid >= 0)
+        {
+            close(session.child.input);
+            close(session.child.frames);
+            fclose(session.child.out_file);
+            reap_child(session.child.pid);
+        }
+    }
+
+    for (auto &[name, pool] : servers)
+    {
+        for (auto &server : pool)
+        {
+            stop_server(server);
+        }
+    }
+
+    if (!scratch.empty())
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(scratch, ec);
+    }
+
+    source.close();
+    target.close();
+    logger.close();
+
+    // Left over if knitting failed
+    std::error_code ec;
+    std::filesystem::remove(temp_target, ec);
+}
+
+const std::list<std::string> &Engine::get_dependencies() const
+{
+    return dependencies;
+}
+
+void Engine::add_dependency(const std::string &_path)
+{
+    if (std::find(dependencies.begin(), dependencies.end(),
+                  _path) == dependencies.end())
+    {
+        dependencies.push_back(_path);
+    }
+}
+
+// The paths a line of text refers to, as markdown images or as
+// LaTeX `\includegraphics`, `\input` or `\include`
+static std::list<std::string> asset_paths(
+    const std::string &_line)
+{
+    std::list<std::string> out;
+    uint64_t at = 0;
+    while ((at = _line.find("![", at)) != std::string::npos)
+    {
+        const auto open = _line.find("](", at);
+        const auto close = _line.find(')', open);
+        if (open == std::string::npos ||
+            close == std::string::npos)
+        {
+            break;
+        }
+
+        // Leaving off any title
+        auto path = _line.substr(open + 2, close - open - 2);
+        path = path.substr(0, path.find(' '));
+        out.push_back(path);
+        at = close;
+    }
+
+    for (const std::string command :
+         {"\\includegraphics", "\\input", "\\include"})
+    {
+        at = 0;
+        while ((at = _line.find(command, at)) !=
+               std::string::npos)
+        {
+            at += command.size();
+            if (at < _line.size() && isalpha(_line[at]))
+            {
+                // Some other command, like `\includeonly`
+                continue;
+            }
+
+            const auto open = _line.find('{', at);
+            const auto close = _line.find('}', open);
+            if (open == std::string::npos ||
+                close == std::string::npos)
+            {
+                break;
+            }
+            out.push_back(
+                _line.substr(open + 1, close - open - 1));
+            at = close;
+        }
+    }
+    return out;
+}
+
+// Add the local files a text chunk refers to, relative to the
+// file it is from. Those which do not exist yet (such as images
+// made by code) and URLs are left out.
+void Engine::add_assets(const Chunk &_text,
+                        const std::string &_from)
+{
+    const auto dir = std::filesystem::path(_from).parent_path();
+    for (const auto &line : _text.lines)
+    {
+        for (const auto &path : asset_paths(line))
+        {
+            if (path.empty() ||
+                path.find("://") != std::string::npos)
+            {
+                continue;
+            }
+
+            // `\input{foo}` may mean `foo.tex`
+            std::error_code ec;
+            for (const auto &candidate :
+                 {dir / path, dir / (path + ".tex")})
+            {
+                if (std::filesystem::is_regular_file(candidate,
+                                                     ec))
+                {
+                    add_dependency(
+                        candidate.lexically_normal().string());
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Whether the two files have the same contents
+static bool same_contents(const std::string &_a,
+                          const std::string &_b)
+{
+    std::error_code ec;
+    if (std::filesystem::file_size(_a, ec) !=
+            std::filesystem::file_size(_b, ec) ||
+        ec)
+    {
+        return false;
+    }
+
+    std::ifstream a(_a, std::ios::binary),
+        b(_b, std::ios::binary);
+    char buffer_a[4096], buffer_b[4096];
+    while (a && b)
+    {
+        a.read(buffer_a, sizeof(buffer_a));
+        b.read(buffer_b, sizeof(buffer_b));
+        if (a.gcount() != b.gcount() ||
+            memcmp(buffer_a, buffer_b, a.gcount()) != 0)
+        {
+            return false;
+        }
+    }
+
+    return a.eof() && b.eof();
+}
+
+void Engine::save_target()
+{
+    target.close();
+
+    if (same_contents(temp_target, settings.target))
+    {
+        // Leave the target (and its mtime) alone
+        std::filesystem::remove(temp_target);
+        logger.write(LogLevel::info, "target",
+                     {{"path", settings.target},
+                      {"changed", false}});
+    }
+    else
+    {
+        std::filesystem::rename(temp_target, settings.target);
+    }
+}
+
+// Load a file, read each line as settings
+void Engine::load_settings_file(const std::string &_filepath)
+{
+    // Open file
+    std::ifstream f(_filepath);
+    if (!f.is_open())
+    {
+        throw std::runtime_error(
+            "Failed to open settings file '" + _filepath + "'");
+    }
+
+    logger.write(LogLevel::info, "settings_file",
+                 {{"path", _filepath}});
+    add_dependency(_filepath);
+
+    // Iterate over lines
+    std::string line;
+    while (!f.eof())
+    {
+        getline(f, line);
+        load_settings_line(line);
+    }
+
+    // Close file
+    f.close();
+}
+
+// Read the next word, which may be quote-enclosed. For
+// `key=value` attributes, the value may be quoted instead.
+std::string read_field(std::stringstream &_from,
+                       const bool _attribute = false)
+{
+    std::string out, word;
+    _from >> out;
+
+    uint64_t quote_at = 0;
+    if (_attribute && out.find('=') != std::string::npos)
+    {
+        quote_at = out.find('=') + 1;
+    }
+
+    if (quote_at < out.size() &&
+        (out[quote_at] == '\'' || out[quote_at] == '"'))
+    {
+        const char quote = out[quote_at];
+        while ((out.size() == quote_at + 1 ||
+                out.back() != quote) &&
+               _from >> word)
+        {
+            out += ' ' + word;
+        }
+
+        out.erase(quote_at, 1);
+        if (out.size() > quote_at && out.back() == quote)
+        {
+            out.pop_back();
         }
-
-        print_call.erase(0, 1);
-        print_call.pop_back();
     }
 
+    return out;
+}
+
+void Engine::load_settings_line(const std::string &_line)
+{
+    std::string name, path, print_call, extension;
+    std::stringstream from_stream(_line);
+    Builder toAdd;
+
+    name = read_field(from_stream);
+    path = read_field(from_stream);
+    print_call = read_field(from_stream);
+
     // Handle extension
     from_stream >> extension;
     if (extension == "")
@@ -432,6 +2722,95 @@ void Engine::load_settings_line(const std::string &_line)
         extension = "txt";
     }
 
+    // Handle `key=value` attributes
+    cpu_set_t cpus;
+    uint64_t number;
+    while (!(from_stream >> std::ws).eof())
+    {
+        const auto attribute = read_field(from_stream, true);
+        const auto eq = attribute.find('=');
+        const auto key = attribute.substr(0, eq);
+        const auto value = eq == std::string::npos
+                               ? ""
+                               : attribute.substr(eq + 1);
+
+        if (key == "compile")
+        {
+            toAdd.compileCommand = value;
+        }
+        else if (key == "run")
+        {
+            toAdd.runCommand = value;
+        }
+        else if (key == "prewarm")
+        {
+            toAdd.prewarm = value;
+        }
+        else if (key == "server")
+        {
+            toAdd.server = value;
+        }
+        else if (key == "checkpoint")
+        {
+            toAdd.checkpoint = value;
+        }
+        else if (key == "inline")
+        {
+            toAdd.printInline = value;
+        }
+        else if (key == "cache" &&
+                 (value == "0" || value == "1"))
+        {
+            toAdd.cache = value == "1";
+        }
+        else if (key == "env" &&
+                 value.find('=') != std::string::npos)
+        {
+            toAdd.env.push_back(value);
+        }
+        else if (key == "cpus" && parse_cpu_list(value, cpus))
+        {
+            toAdd.cpus = value;
+        }
+        else if ((key == "max" || key == "cores" ||
+                  key == "threads") &&
+                 parse_count(value, number) &&
+                 (key != "max" ||
+                  number <= uint64_t(Limit::max())))
+        {
+            if (key == "max")
+            {
+                toAdd.max_instances = number;
+            }
+            else if (key == "cores")
+            {
+                toAdd.cores = number;
+            }
+            else
+            {
+                toAdd.threads = number;
+            }
+        }
+        else if (settings.all_errors)
+        {
+            throw std::runtime_error(
+                "Invalid builder attribute '" + attribute +
+                "'");
+        }
+        else
+        {
+            std::cerr << "WARNING: "
+                      << "Invalid builder attribute '"
+                      << attribute << "'\n";
+        }
+    }
+
+    if (!toAdd.compileCommand.empty() &&
+        toAdd.runCommand.empty())
+    {
+        toAdd.runCommand = "@";
+    }
+
     // Process stuff
     name = strip_string(name);
     for (uint64_t i = 0; i < name.size(); ++i)
@@ -447,94 +2826,236 @@ void Engine::load_settings_line(const std::string &_line)
     extension = strip_string(extension);
 
     // Add to list of loaders
-    Builder toAdd;
     toAdd.printChunkBreak = print_call;
     toAdd.commandPath = path;
     toAdd.extension = extension;
     builders[name] = toAdd;
 
-    // Log if log is on
-    if (settings.log)
+    logger.write(LogLevel::debug, "builder",
+                 {{"name", name},
+                  {"command", path},
+                  {"extension", extension},
+                  {"print", print_call},
+                  {"compile", toAdd.compileCommand},
+                  {"run", toAdd.runCommand}});
+}
+
+////////////////////////////////////////////////////////////////
+
+Engine::PhaseTimer::PhaseTimer(Engine &_engine,
+                               const std::string &_phase)
+    : into(_engine.stats.phases[_phase]), mem(mem_snapshot()),
+      start(std::chrono::high_resolution_clock::now())
+{
+}
+
+Engine::PhaseTimer::~PhaseTimer()
+{
+    stop();
+}
+
+void Engine::PhaseTimer::stop()
+{
+    if (stopped)
     {
-        log << "Added builder:\n"
-            << "\tName:  '" << name << "'\n"
-            << "\tCmd:   '" << path << "'\n"
-            << "\tExten: '" << extension << "'\n"
-            << "\tPrint: '" << print_call << "'\n";
+        return;
     }
+    stopped = true;
+
+    const auto now_mem = mem_snapshot();
+    into.us += std::chrono::duration_cast<
+                   std::chrono::microseconds>(
+                   std::chrono::high_resolution_clock::now() -
+                   start)
+                   .count();
+    into.allocations += now_mem.allocations - mem.allocations;
+    into.bytes += now_mem.bytes - mem.bytes;
+    into.peak_rss_kb = now_mem.peak_rss_kb;
 }
 
-////////////////////////////////////////////////////////////////
+// Knit the given chunks into this engine's target and those of
+// `_others`, the latter on their own threads
+void Engine::knit_all(const std::list<Chunk> &_chunks,
+                      const std::list<Engine *> &_others)
+{
+    // Every other target gets the same resolved chunks, so no
+    // code is executed more than once. Workers are joined on
+    // the way out, even if this target's knit throws.
+    std::list<std::exception_ptr> errors;
+    std::list<std::jthread> workers;
+    for (auto *other : _others)
+    {
+        errors.emplace_back();
+        workers.emplace_back(
+            [other, &_chunks](std::exception_ptr &_error)
+            {
+                try
+                {
+                    other->knit(_chunks);
+                }
+                catch (...)
+                {
+                    _error = std::current_exception();
+                }
+            },
+            std::ref(errors.back()));
+    }
+
+    knit(_chunks);
+
+    workers.clear();
+    for (const auto &error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
 
-RunStats Engine::run()
+// The microseconds within [`_start`, `_stop`] during which at
+// least one of the given intervals was underway
+static uint64_t busy_us(
+    std::vector<std::pair<
+        std::chrono::high_resolution_clock::time_point,
+        std::chrono::high_resolution_clock::time_point>>
+        _intervals,
+    const std::chrono::high_resolution_clock::time_point _start,
+    const std::chrono::high_resolution_clock::time_point _stop)
 {
-    // Set up stats
-    RunStats stats;
-    external_us = 0;
-    stats.start = std::chrono::high_resolution_clock::now();
+    std::sort(_intervals.begin(), _intervals.end());
 
-    // Parse
-    if (settings.log)
+    std::chrono::high_resolution_clock::duration out{0};
+    auto reached = _start;
+    for (const auto &[from, to] : _intervals)
     {
-        log << "Parsing...\n";
+        const auto begin = std::max(from, reached);
+        const auto end = std::min(to, _stop);
+        if (begin < end)
+        {
+            out += end - begin;
+            reached = end;
+        }
     }
+
+    return std::chrono::duration_cast<
+               std::chrono::microseconds>(out)
+        .count();
+}
+
+RunStats Engine::run(const std::list<Engine *> &_others)
+{
+    // Set up stats
+    stats = RunStats();
+    busy.clear();
+    stats.start = std::chrono::high_resolution_clock::now();
+
+    // Parse
+    logger.write(LogLevel::info, "phase", {{"phase", "parse"}});
     auto chunks = parse();
 
-    // Construct output
-    if (settings.log)
+    // Planning stops short of running code, so there is
+    // nothing to knit and the targets are left alone
+    if (settings.plan)
     {
-        log << "Passing knitting to derived class...\n";
+        stats.stop = std::chrono::high_resolution_clock::now();
+        return stats;
     }
-    knit(chunks);
-    if (settings.log)
+
+    // Construct output
+    logger.write(LogLevel::info, "phase", {{"phase", "knit"}});
     {
-        log << "Derived class has (presumably) finished.\n";
+        PhaseTimer timer(*this, "knit");
+        knit_all(chunks, _others);
+
+        save_target();
+        for (const auto &other : _others)
+        {
+            other->save_target();
+        }
     }
+    logger.write(LogLevel::info, "phase", {{"phase", "done"}});
 
     // Finalize stats and return
     stats.stop = std::chrono::high_resolution_clock::now();
-    stats.external_us = external_us;
+    stats.external_us = busy_us(busy, stats.start, stats.stop);
     return stats;
 }
 
-// Go through the input, extract code from `jmd` to output.
-// This creates a list of text/code chunks which should then
-// be constructed into output.
-std::list<Chunk> Engine::parse()
+// Parsed fragments, keyed by canonical path. An entry is reused
+// for as long as its file's mtime is unchanged.
+struct Fragment
+{
+    std::filesystem::file_time_type mtime;
+    std::shared_ptr<const std::list<Chunk>> chunks;
+};
+static std::map<std::string, Fragment> fragment_cache;
+static std::mutex fragment_cache_mutex;
+
+// Split jmd into text/code chunks. Nothing is run, configured
+// or included here, so the result only depends on the input.
+std::list<Chunk> Engine::scan_chunks(std::istream &_from)
 {
     std::string line, header;
     Chunk current_chunk;
     uint64_t cur_chunk_ws_prefix = 0;
     std::list<Chunk> output;
     uint64_t whitespace_prefix;
-    std::map<std::string, Chunk> combined_languages;
 
     current_chunk.type = "TEXT";
 
-    while (!source.eof())
+    // Read whole, so that the lines which may be fences are
+    // found by a bulk search for backticks rather than by
+    // looking at every line
+    const std::string text(
+        std::istreambuf_iterator<char>(_from), {});
+    uint64_t begin = 0, line_number = 0,
+             fence = find_fence_byte(text.data(), text.size());
+
+    while (true)
     {
-        getline(source, line);
+        ++line_number;
+        auto end = text.find('\n', begin);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+        line.assign(text, begin, end - begin);
 
-        whitespace_prefix = 0;
-        while (line[whitespace_prefix] == ' ' ||
-               line[whitespace_prefix] == '\t')
+        bool is_fence = false;
+        if (fence < end)
         {
-            ++whitespace_prefix;
+            whitespace_prefix = line.find_first_not_of(" \t");
+            is_fence = whitespace_prefix != std::string::npos &&
+                       line.compare(whitespace_prefix, 3,
+                                    "```") == 0;
+            fence = end + find_fence_byte(text.data() + end,
+                                          text.size() - end);
         }
-        header = line.substr(whitespace_prefix);
 
-        if (strncmp(line.c_str() + whitespace_prefix, "```",
-                    3) == 0)
+        if (is_fence)
         {
+            header = line.substr(whitespace_prefix);
             output.push_back(current_chunk);
 
             if (current_chunk.type == "TEXT")
             {
                 // Beginning a code chunk
-                parse_header(header, current_chunk);
+                if (!parse_header(header, current_chunk))
+                {
+                    const std::string message =
+                        "Invalid @bench count on line " +
+                        std::to_string(line_number);
+                    if (settings.all_errors)
+                    {
+                        throw std::runtime_error(message);
+                    }
+                    std::cerr << "WARNING: " << message << '\n';
+                }
                 cur_chunk_ws_prefix = whitespace_prefix;
 
-                if (current_chunk.type == "SETTINGS")
+                if (current_chunk.type == "SETTINGS" ||
+                    current_chunk.type == "INCLUDE")
                 {
                     current_chunk.show_code = false;
                     current_chunk.show_output = false;
@@ -544,58 +3065,16 @@ std::list<Chunk> Engine::parse()
             else
             {
                 // End a code chunk
-
-                // Switch based on combine
-                if (current_chunk.combine)
-                {
-                    const auto lang = current_chunk.type;
-
-                    // Add into existing code for this lang
-                    if (builders.count(lang) != 0)
-                    {
-                        for (const auto &cur_line :
-                             current_chunk.lines)
-                        {
-                            combined_languages[lang]
-                                .lines.push_back(cur_line);
-                        }
-
-                        combined_languages[lang]
-                            .lines.push_back(
-                                builders.at(lang)
-                                    .printChunkBreak);
-                    }
-                    else if (settings.all_errors)
-                    {
-                        throw std::runtime_error(
-                            "Invalid language ID '" + lang +
-                            "'");
-                    }
-                    else
-                    {
-                        std::cerr << "WARNING: "
-                                  << "Invalid language ID '"
-                                  << lang << "'\n";
-                    }
-                }
-
                 current_chunk.show_code = true;
                 current_chunk.combine = true;
                 current_chunk.show_output = true;
                 current_chunk.pos_in_type = 0;
+                current_chunk.bench = 0;
                 current_chunk.type = "TEXT";
             }
 
             current_chunk.lines.clear();
         }
-        else if (current_chunk.type == "SETTINGS")
-        {
-            if (settings.log)
-            {
-                log << "Settings line '" << line << "'\n";
-            }
-            load_settings_line(line);
-        }
         else if (!line.empty())
         {
             if (cur_chunk_ws_prefix <= line.size() &&
@@ -613,125 +3092,541 @@ std::list<Chunk> Engine::parse()
         {
             current_chunk.lines.push_back(line);
         }
+
+        if (end == text.size())
+        {
+            break;
+        }
+        begin = end + 1;
     }
     output.push_back(current_chunk);
 
-    // Build all combined languages
-    std::map<std::string, std::queue<Chunk>> combined_output;
-    for (const auto &p : combined_languages)
-    {
-        const auto lang = p.first;
-        const auto src = p.second;
-        const auto builder = builders.at(lang);
+    return output;
+}
 
-        if (settings.log)
+// Get the chunks of the given fragment, scanning it only if it
+// is not cached or has changed since
+std::shared_ptr<const std::list<Chunk>> Engine::load_fragment(
+    const std::string &_path)
+{
+    const auto mtime = std::filesystem::last_write_time(_path);
+
+    {
+        std::lock_guard<std::mutex> lock(fragment_cache_mutex);
+        const auto it = fragment_cache.find(_path);
+        if (it != fragment_cache.end() &&
+            it->second.mtime == mtime)
         {
-            log << "Building knitted chunk in lang '" << lang
-                << "'...\n";
+            logger.write(LogLevel::debug, "fragment",
+                         {{"path", _path}, {"cached", true}});
+            return it->second.chunks;
         }
+    }
+
+    std::ifstream f(_path);
+    if (!f.is_open())
+    {
+        throw std::runtime_error("Failed to open fragment '" +
+                                 _path + "'");
+    }
+
+    logger.write(LogLevel::debug, "fragment",
+                 {{"path", _path}, {"cached", false}});
+
+    Fragment fragment;
+    fragment.mtime = mtime;
+    fragment.chunks =
+        std::make_shared<const std::list<Chunk>>(
+            scan_chunks(f));
+
+    std::lock_guard<std::mutex> lock(fragment_cache_mutex);
+    fragment_cache[_path] = fragment;
+    return fragment.chunks;
+}
+
+bool Engine::in_section() const
+{
+    return settings.section.empty() ||
+           (section_level != 0 && !section_ended);
+}
+
+// Append a text chunk onto `_into`, split where it enters or
+// leaves the section
+void Engine::split_section(const Chunk &_text,
+                           std::list<Chunk> &_into)
+{
+    Chunk piece = _text;
+    piece.lines.clear();
+    piece.in_section = in_section();
 
-        const auto output = run_code_chunk(builder, src);
-        combined_output[lang] = break_output_chunk(output);
+    std::string title;
+    for (const auto &line : _text.lines)
+    {
+        const auto level = heading_level(line, title);
+        if (level != 0 && section_level == 0 &&
+            title == settings.section)
+        {
+            section_level = level;
+        }
+        else if (level != 0 && section_level != 0 &&
+                 level <= section_level)
+        {
+            section_ended = true;
+            break;
+        }
 
-        if (settings.log)
+        if (piece.in_section != in_section())
         {
-            log << "Done.\n";
+            _into.push_back(piece);
+            piece.lines.clear();
+            piece.in_section = in_section();
         }
+        piece.lines.push_back(line);
     }
+    _into.push_back(piece);
+}
 
-    // Run any remaining code and break into chunks
-    for (auto it = output.begin(); it != output.end(); ++it)
+// Append the given chunks from the file `_from` onto `_into`,
+// loading settings and splicing in includes along the way
+void Engine::splice_chunks(const std::list<Chunk> &_chunks,
+                           const std::string &_from,
+                           std::list<Chunk> &_into)
+{
+    for (const auto &chunk : _chunks)
     {
-        const auto lang = it->type;
-
-        if (lang == "TEXT" || lang == "SETTINGS")
+        if (section_ended)
         {
-            // Normal text block; Do nothing
-            continue;
+            // Nothing after the section is needed
+            return;
         }
-        else if (it->combine)
+        else if (chunk.type == "SETTINGS")
         {
-            // Get front from combined output
-            if (!combined_output[lang].empty())
+            for (const auto &line : chunk.lines)
             {
-                const auto to_insert =
-                    combined_output[lang].front();
-                combined_output[lang].pop();
+                if (line.empty())
+                {
+                    continue;
+                }
 
-                // Insert after this item
-                ++it;
-                output.insert(it, to_insert);
-                --it;
+                logger.write(LogLevel::debug, "settings_line",
+                             {{"line", line}});
+                load_settings_line(line);
             }
-            else if (settings.all_errors)
-            {
-                throw std::runtime_error(
-                    "No remaining output for lang '" + lang +
-                    "'");
-            }
-            else
+
+            _into.push_back(chunk);
+            _into.back().lines.clear();
+            _into.back().in_section = in_section();
+        }
+        else if (chunk.type == "INCLUDE")
+        {
+            // One path per line, relative to the including file
+            const auto dir =
+                std::filesystem::path(_from).parent_path();
+            for (const auto &line : chunk.lines)
             {
-                std::cerr << "WARNING: "
-                          << "No remaining output for lang '"
-                          << lang << "'\n";
+                // Ignoring surrounding whitespace
+                const auto start =
+                    line.find_first_not_of(" \t\r");
+                if (start != std::string::npos)
+                {
+                    const auto end =
+                        line.find_last_not_of(" \t\r");
+                    const auto name =
+                        line.substr(start, end - start + 1);
+                    include_file(dir / name, _into);
+                }
             }
         }
         else
         {
-            // Run as independent chunk now
-            if (builders.count(lang) != 0)
+            if (chunk.type == "TEXT")
+            {
+                add_assets(chunk, _from);
+            }
+
+            // Start this session's interpreter, or this lone
+            // chunk, while parsing. Before the section, lone
+            // chunks are not run and sessions may not be.
+            if (chunk.type != "TEXT" && in_section())
+            {
+                if (chunk.combine)
+                {
+                    prewarm(chunk.type);
+                }
+                else
+                {
+                    start_lone(chunk);
+                }
+            }
+            if (chunk.type != "TEXT" && chunk.combine)
             {
-                if (settings.log)
+                session_seen = true;
+            }
+            else if (chunk.type == "TEXT" && !session_seen)
+            {
+                // Inline spans are session code too
+                for (const auto &line : chunk.lines)
                 {
-                    log << "Building loner chunk in lang '"
-                        << lang << "'...\n```\n";
+                    if (!inline_spans(line).empty())
+                    {
+                        session_seen = true;
+                        break;
+                    }
                 }
+            }
+
+            if (chunk.type == "TEXT" &&
+                !settings.section.empty())
+            {
+                split_section(chunk, _into);
+                continue;
+            }
+            _into.push_back(chunk);
+            _into.back().in_section = in_section();
+        }
+    }
+}
+
+// Splice the chunks of the given jmd file onto `_into`
+void Engine::include_file(const std::filesystem::path &_path,
+                          std::list<Chunk> &_into)
+{
+    std::string path;
+    std::shared_ptr<const std::list<Chunk>> chunks;
+
+    try
+    {
+        path =
+            std::filesystem::weakly_canonical(_path).string();
+        for (const auto &including : include_stack)
+        {
+            if (including == path)
+            {
+                throw std::runtime_error(
+                    "Circular include of '" + path + "'");
+            }
+        }
+
+        chunks = load_fragment(path);
+    }
+    catch (std::exception &e)
+    {
+        if (settings.all_errors)
+        {
+            throw std::runtime_error(e.what());
+        }
+
+        std::cerr << "WARNING: " << e.what() << '\n';
+        return;
+    }
+
+    add_dependency(path);
+    include_stack.push_back(path);
+    splice_chunks(*chunks, path, _into);
+    include_stack.pop_back();
+}
+
+// Go through the input, extract code from `jmd` to output.
+// This creates a list of text/code chunks which should then
+// be constructed into output.
+std::list<Chunk> Engine::parse()
+{
+    std::list<Chunk> output;
+    std::map<std::string, Chunk> combined_languages;
 
-                const auto builder = builders.at(lang);
-                const auto to_insert =
-                    run_code_chunk(builder, *it);
+    PhaseTimer parse_timer(*this, "parse");
+    include_stack = {
+        std::filesystem::weakly_canonical(settings.source)
+            .string()};
+    splice_chunks(scan_chunks(source), settings.source,
+                  output);
+    if (!settings.section.empty() && section_level == 0)
+    {
+        if (settings.all_errors)
+        {
+            throw std::runtime_error("No section '" +
+                                     settings.section + "'");
+        }
+        std::cerr << "WARNING: " << "No section '"
+                  << settings.section << "'\n";
+    }
 
-                if (settings.log)
+    // Whether an inline span is run in its language's session
+    const auto evaluates = [&](const InlineSpan &_span) {
+        const auto builder = builders.find(_span.lang);
+        return !_span.expr.empty() &&
+               builder != builders.end() &&
+               !builder->second.printInline.empty() &&
+               builder->second.compileCommand.empty();
+    };
+
+    // Gather code for each combined session, including inline
+    // spans, in document order. Sessions the section does not
+    // use are dropped afterwards.
+    std::set<std::string> used_languages;
+    std::map<std::string, std::vector<std::list<std::string>>>
+        session_chunks;
+    for (const auto &chunk : output)
+    {
+        if (chunk.type == "TEXT")
+        {
+            for (const auto &line : chunk.lines)
+            {
+                for (const auto &span : inline_spans(line))
                 {
-                    log << "Done.\n";
+                    if (!evaluates(span))
+                    {
+                        continue;
+                    }
+
+                    const auto &b = builders.at(span.lang);
+                    std::string code;
+                    for (const auto c : b.printInline)
+                    {
+                        code += c == '%' ? span.expr
+                                         : std::string(1, c);
+                    }
+
+                    auto &lines =
+                        combined_languages[span.lang].lines;
+                    lines.push_back(code);
+                    lines.push_back(b.printChunkBreak);
+                    session_chunks[span.lang].push_back({code});
+                    if (chunk.in_section)
+                    {
+                        used_languages.insert(span.lang);
+                    }
                 }
+            }
+            continue;
+        }
+        else if (!chunk.combine)
+        {
+            continue;
+        }
+
+        const auto lang = chunk.type;
 
-                // Insert after this item
-                ++it;
-                output.insert(it, to_insert);
-                --it;
+        // Add into existing code for this lang
+        if (builders.count(lang) != 0)
+        {
+            for (const auto &cur_line : chunk.lines)
+            {
+                combined_languages[lang].lines.push_back(
+                    cur_line);
             }
 
-            // Unknown builder; Attempt to treat as command
-            else
+            combined_languages[lang].lines.push_back(
+                builders.at(lang).printChunkBreak);
+            session_chunks[lang].push_back(chunk.lines);
+            if (chunk.in_section)
+            {
+                used_languages.insert(lang);
+            }
+        }
+        else if (settings.all_errors)
+        {
+            throw std::runtime_error("Invalid language ID '" +
+                                     lang + "'");
+        }
+        else
+        {
+            std::cerr << "WARNING: "
+                      << "Invalid language ID '" << lang
+                      << "'\n";
+        }
+    }
+    std::erase_if(combined_languages, [&](const auto &_p) {
+        return used_languages.count(_p.first) == 0;
+    });
+    parse_timer.stop();
+
+    // Combined sessions are run now. Lone chunks have already
+    // been started, unless only planning.
+    // Checkpointed sessions run alongside, chunk by chunk
+    std::vector<Job> jobs;
+    std::map<std::string, std::future<std::queue<Chunk>>>
+        checkpoint_runs;
+    for (const auto &p : combined_languages)
+    {
+        if (checkpointing(builders.at(p.first)) &&
+            !settings.plan)
+        {
+            checkpoint_runs[p.first] =
+                std::async(std::launch::async, [&, p]() {
+                    return run_checkpointed(
+                        p.first, session_chunks.at(p.first));
+                });
+            continue;
+        }
+
+        Job job;
+        job.builder = builders.at(p.first);
+        job.code = p.second;
+        job.code.type = p.first;
+        jobs.push_back(job);
+    }
+
+    std::list<std::list<Chunk>::iterator> lone_chunks;
+    for (auto it = output.begin(); it != output.end(); ++it)
+    {
+        if (it->type == "TEXT" || it->type == "SETTINGS" ||
+            it->combine || !it->in_section)
+        {
+            continue;
+        }
+
+        lone_chunks.push_back(it);
+    }
+
+    PhaseTimer execute_timer(*this, "execute");
+    const auto results = run_jobs(jobs);
+    std::map<std::string, std::queue<Chunk>> combined_output;
+    for (auto &[lang, run] : checkpoint_runs)
+    {
+        combined_output[lang] = run.get();
+    }
+    release_held();
+    finish_started();
+    if (interrupted)
+    {
+        throw std::runtime_error("Interrupted");
+    }
+    if (started_error)
+    {
+        std::rethrow_exception(started_error);
+    }
+    for (const auto &lone : started)
+    {
+        if (lone.job.succeeded)
+        {
+            history.record(lone.job.key, lone.job.took);
+        }
+    }
+    history.save();
+    execute_timer.stop();
+
+    if (settings.plan)
+    {
+        return output;
+    }
+
+    // Split each session's output into its chunks
+    PhaseTimer split_timer(*this, "split");
+    auto result = results.begin();
+    for (const auto &p : combined_languages)
+    {
+        if (checkpoint_runs.count(p.first) != 0)
+        {
+            continue;
+        }
+        combined_output[p.first] = break_output_chunk(*result);
+        ++result;
+    }
+    split_timer.stop();
+
+    // Insert each lone chunk's output after it
+    auto lone = started.begin();
+    for (const auto &it : lone_chunks)
+    {
+        const auto after = std::next(it);
+        output.insert(after, output_chunk(lone->output.text));
+        if (!lone->output.bench.empty())
+        {
+            output.insert(after,
+                          bench_chunk(lone->output.bench));
+        }
+        ++lone;
+    }
+
+    // Insert session output after each combined chunk, and
+    // substitute it for each inline span
+    for (auto it = output.begin(); it != output.end(); ++it)
+    {
+        const auto lang = it->type;
+
+        if (lang == "TEXT")
+        {
+            for (auto &line : it->lines)
             {
-                if (settings.log)
+                const auto spans = inline_spans(line);
+                std::string substituted;
+                uint64_t copied = 0;
+                for (const auto &span : spans)
                 {
-                    log << "Building loner chunk via command '"
-                        << lang << "'...\n```\n";
-                }
+                    auto &queue = combined_output[span.lang];
+                    if (!evaluates(span) || queue.empty())
+                    {
+                        continue;
+                    }
 
-                Builder builder;
-                builder.commandPath = lang;
-                builder.extension = "txt";
-                builder.printChunkBreak = "";
+                    // Multiple lines are joined by spaces
+                    std::string value;
+                    for (const auto &l : queue.front().lines)
+                    {
+                        if (!l.empty())
+                        {
+                            value += (value.empty() ? "" : " ");
+                            value += l;
+                        }
+                    }
+                    queue.pop();
 
-                const auto to_insert =
-                    run_code_chunk(builder, *it);
+                    substituted += line.substr(
+                        copied, span.begin - copied);
+                    substituted += value;
+                    copied = span.end;
+                }
 
-                if (settings.log)
+                if (copied != 0)
                 {
-                    log << "Done.\n";
+                    line = substituted + line.substr(copied);
                 }
+            }
+            continue;
+        }
 
-                // Insert after this item
-                ++it;
-                output.insert(it, to_insert);
-                --it;
+        if (lang == "TEXT" || lang == "SETTINGS" ||
+            lang == "OUTPUT" || !it->combine)
+        {
+            continue;
+        }
+        else if (!it->in_section)
+        {
+            // Run only for the section's sake
+            if (!combined_output[lang].empty())
+            {
+                combined_output[lang].pop();
             }
+            continue;
+        }
+
+        // Get front from combined output
+        if (!combined_output[lang].empty())
+        {
+            const auto to_insert =
+                combined_output[lang].front();
+            combined_output[lang].pop();
+
+            // Insert after this item
+            it = output.insert(std::next(it), to_insert);
+        }
+        else if (settings.all_errors)
+        {
+            throw std::runtime_error(
+                "No remaining output for lang '" + lang + "'");
+        }
+        else
+        {
+            std::cerr << "WARNING: "
+                      << "No remaining output for lang '"
+                      << lang << "'\n";
         }
     }
 
+    output.remove_if(
+        [](const Chunk &_chunk) { return !_chunk.in_section; });
+
     // Return built output
     return output;
 }
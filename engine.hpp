@@ -7,32 +7,234 @@ Jordan Dehmel
 
 #pragma once
 
+#include "history.hpp"
+#include "logger.hpp"
+#include "mem_stats.hpp"
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
+#include <future>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
+#include <sched.h>
+#include <semaphore>
 #include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
 
-const static std::string VERSION = "0.1.4";
+const static std::string VERSION = "0.1.5";
 
 struct Settings
 {
     std::string source, target;
     bool time = false, log = false, all_errors = false,
          forceFancyFonts = false;
+
+    // Print the predicted schedule instead of running code
+    bool plan = false;
+
+    // How many chunks or sessions may run at once. Above 1,
+    // they run longest-first rather than in document order.
+    uint64_t jobs = 1;
+
+    // Time external commands even without `time`, for metrics
+    bool metrics = false;
+
+    // If set, only the section under the `#` heading with this
+    // title is knit, and only the code it needs is run
+    std::string section;
+
+    // In `tex`, code and output blocks of more lines than this
+    // are written to side files beside the target. At 0, every
+    // block is written inline.
+    uint64_t externalize_lines = 0;
+
+    // Knit again whenever a dependency changes. Sessions with a
+    // `checkpoint` driver keep stopped copies of their
+    // interpreters, up to this many MB each, to resume from.
+    bool watch = false;
+    uint64_t checkpoint_mb = 1024;
+
+    // Where `log` writes, and the most detail it writes
+    std::string log_file = "jknit.log";
+    LogLevel log_level = LogLevel::debug;
+};
+
+// Time, allocations and peak RSS for one phase of a run. Peak
+// RSS is that of the whole process as of the end of the phase.
+struct PhaseStats
+{
+    uint64_t us = 0, allocations = 0, bytes = 0;
+    uint64_t peak_rss_kb = 0;
 };
 
+// Resource use of a single external command
+struct ChildStats
+{
+    std::string command;
+    uint64_t us = 0, max_rss_kb = 0, user_us = 0, sys_us = 0;
+};
+
+// What was run for one language
+struct LanguageStats
+{
+    uint64_t sessions = 0, lone = 0, failures = 0;
+    uint64_t output_bytes = 0;
+};
+
+// The phases of a run, in order
+const static std::list<std::string> PHASES = {
+    "parse", "execute", "split", "knit"};
+
 struct RunStats
 {
     std::chrono::high_resolution_clock::time_point start, stop;
     uint64_t external_us = 0;
+    std::map<std::string, PhaseStats> phases;
+    std::list<ChildStats> children;
+    std::map<std::string, LanguageStats> languages;
+    uint64_t cache_hits = 0, cache_misses = 0;
 };
 
+// How to run code in a given language. If `compileCommand` is
+// set, the code is built by it first and `runCommand` is run
+// instead of `commandPath`. The rest limit the resources of
+// its commands; zero or empty means no limit.
 struct Builder
 {
     std::string printChunkBreak, commandPath, extension;
+    std::string compileCommand, runCommand;
+
+    // Prints the value of an inline `{lang} expr` span in this
+    // builder's session, with `%` replaced by the expression
+    std::string printInline;
+
+    // Most commands of this builder to run at once
+    uint64_t max_instances = 0;
+
+    // Pin to a CPU list (like "0-3,6"), or to this many CPUs
+    std::string cpus;
+    uint64_t cores = 0;
+
+    // Thread count for OpenMP and BLAS, and "KEY=VALUE"s
+    uint64_t threads = 0;
+    std::list<std::string> env;
+
+    // If set, a command which runs lone chunks (or their
+    // binaries, if compiled) on request rather than once per
+    // chunk (see `py_fork_server.py` and `so_host.cpp`)
+    std::string server;
+
+    // If set, a command which reads a session's code from
+    // stdin. It is started as soon as the session is seen.
+    std::string prewarm;
+
+    // If set, under `--watch`, a command which runs a session
+    // one chunk at a time (see `py_checkpoint.py` and
+    // `Checkpointed`)
+    std::string checkpoint;
+
+    // Whether binaries may be reused from the artifact cache.
+    // Off by default, as only the chunk's own code is hashed.
+    bool cache = false;
+};
+
+// A command which has been started but not yet waited on. If
+// `input` is not negative, it is the write end of its stdin.
+struct Child
+{
+    pid_t pid = -1;
+    FILE *out_file = nullptr;
+    int frames = -1, input = -1;
+    std::chrono::high_resolution_clock::time_point start;
+};
+
+// Kill every command JKnit is running and refuse to start more,
+// so that the run fails and its engines clean up as they are
+// destroyed. Safe to call from a signal handler.
+void interrupt_commands();
+
+// A long-lived process which runs lone chunks. Each request is
+// a line of the source, output file and scratch directory,
+// separated by tabs. Each reply is a line of the exit status,
+// max RSS in KB and user and system microseconds. A server
+// handles one request at a time, so it is `busy` until it has
+// replied.
+struct Server
+{
+    pid_t pid = -1;
+    FILE *requests = nullptr, *replies = nullptr;
+    bool busy = false;
+};
+
+// A session run one chunk at a time by a `checkpoint` driver,
+// which leaves a stopped copy of its interpreter after each
+// chunk. These outlive any one engine, so that the next run
+// under `--watch` can resume from the copy taken just before
+// its first changed chunk, rather than from the top.
+struct Checkpointed
+{
+    // A chunk the current interpreter has run, known by a hash
+    // of it and every chunk before it. `copy` is the pid of
+    // the stopped copy taken after it, if kept.
+    struct Step
+    {
+        uint64_t hash = 0, us = 0;
+        std::string output;
+        pid_t copy = -1;
+    };
+
+    // `pidfd` watches `active`, whose copies hold `replies`
+    // open, so that its death is noticed. `scratch` lasts for
+    // as long as the session, so that a resumed copy still has
+    // the files its chunks wrote there.
+    std::string command, scratch;
+    pid_t driver = -1, active = -1;
+    int pidfd = -1;
+    FILE *requests = nullptr, *replies = nullptr;
+    std::vector<Step> steps;
+
+    ~Checkpointed();
+
+    // Kill the interpreter and every copy
+    void stop();
+};
+
+// A single record from the out-of-band framing channel: The
+// number of bytes the child had written to stdout when it
+// reached a chunk break, and when jknit received the record.
+struct Frame
+{
+    uint64_t bytes;
+    std::chrono::high_resolution_clock::time_point at;
+};
+
+// The resources used by one run of an external command
+struct Usage
+{
+    uint64_t wall_us = 0, user_us = 0, sys_us = 0,
+             max_rss_kb = 0;
+};
+
+// The raw result of running an external command. `frames` is
+// empty unless the command wrote break records to fd 3, and
+// `bench` holds the usage of any timed repeat runs.
+struct CommandOutput
+{
+    std::string text;
+    std::list<Frame> frames;
+    std::chrono::high_resolution_clock::time_point start;
+    Usage usage;
+    std::vector<Usage> bench;
 };
 
 // A text or code chunk. There are four types here: Text
@@ -47,6 +249,31 @@ struct Chunk
     std::list<std::string> lines;
 
     bool show_code = true, show_output = true, combine = true;
+
+    // Timed runs after a warmup, from an `@bench=N` header
+    uint64_t bench = 0;
+
+    // False before `--section`. Such chunks are not knit, and
+    // are only run as part of a session the section uses.
+    bool in_section = true;
+};
+
+// A lone chunk or combined session to be run, along with its
+// files and its (possibly still running) compile step
+struct Job
+{
+    Builder builder;
+    Chunk code;
+    std::string scratch, source, binary;
+    std::shared_future<void> compiled;
+
+    // Shared by all jobs with a builder with `max_instances`
+    std::counting_semaphore<> *limit = nullptr;
+
+    // For the history: What this job is, how long it took
+    uint64_t key = 0;
+    Timing took;
+    bool succeeded = false;
 };
 
 // Virtual base class; This does not say how to implement
@@ -58,38 +285,270 @@ class Engine
 {
   public:
     Engine(const Settings &_s);
-    ~Engine();
+    virtual ~Engine();
 
     void load_settings_file(const std::string &_filepath);
     void load_settings_line(const std::string &_line);
 
-    RunStats run();
+    // Parse and execute the source once, then knit the
+    // resolved chunks into this engine's target as well as
+    // into the targets of each of `_others` (in parallel).
+    RunStats run(const std::list<Engine *> &_others = {});
+
+    // Every file read so far: The source, settings files,
+    // included fragments and the local files their text refers
+    // to (images, `\input` and so on)
+    const std::list<std::string> &get_dependencies() const;
 
   protected:
     Settings settings;
     std::ifstream source;
-    std::ofstream target, log;
+    std::ofstream target;
+    Logger logger;
+    std::list<std::string> dependencies;
+    void add_dependency(const std::string &_path);
+    void add_assets(const Chunk &_text,
+                    const std::string &_from);
+
+    // The target is written to a temporary file beside it,
+    // which only replaces it if their contents differ. Only
+    // called once the whole knit has succeeded.
+    std::string temp_target;
+    virtual void save_target();
     std::map<std::string, Builder> builders;
 
-    // Pseudo-RNG to help avoid local collisions in filenames
-    const std::string magic_number = std::to_string(time(NULL));
+    // Filled in over the course of `run`
+    RunStats stats;
 
-    // Run a code chunk and return its output as a chunk
-    Chunk run_code_chunk(const Builder &_builder,
-                         const Chunk &_code);
+    // Accumulates into the given phase of `stats` while alive
+    class PhaseTimer
+    {
+      public:
+        PhaseTimer(Engine &_engine, const std::string &_phase);
+        ~PhaseTimer();
 
-    // Run the given shell command and get its output.
-    uint64_t external_us = 0;
-    Chunk run_and_get_output(const std::string &_cmd);
+        // End the phase early
+        void stop();
+
+      protected:
+        bool stopped = false;
+        PhaseStats &into;
+        MemSnapshot mem;
+        std::chrono::high_resolution_clock::time_point start;
+    };
+
+    // This run's private scratch directory, which holds a
+    // directory per job. Made on first use, removed on exit.
+    std::string scratch;
+    void make_scratch();
+
+    // Write a job's code to its source file
+    bool write_source(const Job &_job);
+
+    // Run each job, in order, and return their raw outputs.
+    // Compile steps all start up front and run in parallel, so
+    // a job runs as soon as its own binary is ready.
+    std::vector<CommandOutput> run_jobs(
+        std::vector<Job> &_jobs);
+
+    // Run a single job whose compile has been started
+    void finish_job(Job &_job, CommandOutput &_into);
+
+    // Count a finished or failed job towards the stats
+    void record_job(const Job &_job, const CommandOutput &_out);
+
+    // How many compiles, and how many runs, may go at once
+    using Limit = std::counting_semaphore<>;
+    std::unique_ptr<Limit> compile_slots, run_slots;
+
+    // One shared limit per builder name with `max_instances`
+    std::map<std::string, std::unique_ptr<Limit>> limits;
+
+    // Give a job its scratch directory, source file and limit,
+    // and start its compile (if any) on a thread in `_into`
+    void start_job(Job &_job, const std::string &_name,
+                   std::list<std::jthread> &_into);
+
+    // Build a job's binary, or point it at a cached one built
+    // from the same code by the same command and compiler
+    void compile(Job &_job);
+    std::string cached_binary(const Job &_job);
+
+    // The `--version` output of each compiler, once known
+    std::map<std::string, std::string> compiler_versions;
+    std::mutex compiler_versions_mutex;
+
+    // Timings of past runs, saved once everything has run
+    History history;
 
-    // Break a single output chunk into multiple
-    std::queue<Chunk> break_output_chunk(const Chunk &_c);
+    // The job for a lone chunk, with its builder as of now
+    Job lone_job(const Chunk &_chunk);
+
+    // Lone chunks need nothing from later in the document, so
+    // they are started as soon as they are parsed, if a run
+    // slot is free. Those which are not are `unstarted`, and
+    // start longest predicted first, as `run_jobs` does, ahead
+    // of any session. With one job at a time, they run in
+    // document order, and those after any session code are
+    // held until the sessions have run, as they always were.
+    struct Started
+    {
+        Job job;
+        CommandOutput output;
+        bool held = false;
+
+        // Waiting chunks start by descending `priority` (the
+        // predicted time, with never-run chunks highest), then
+        // in document order
+        int64_t predicted = -1;
+        uint64_t priority = 0, index = 0;
+    };
+    struct StartsLater
+    {
+        bool operator()(const Started *_a,
+                        const Started *_b) const;
+    };
+    std::list<Started> started;
+    std::priority_queue<Started *, std::vector<Started *>,
+                        StartsLater>
+        unstarted;
+    std::queue<Started *> claimed;
+    bool parsed = false;
+    std::exception_ptr started_error;
+    std::mutex started_mutex;
+    std::condition_variable started_cv;
+    std::list<std::jthread> started_compilers, started_workers;
+    bool session_seen = false;
+    void start_lone(const Chunk &_chunk);
+    void queue_started(Started &_lone);
+    void release_held();
+    void run_started();
+
+    // Wait for every started chunk. Any error is left in
+    // `started_error`.
+    void finish_started();
+
+    // Predicted microseconds for a job from the history, or -1
+    // if it has never run
+    int64_t predict(const Job &_job);
+
+    // Print the order jobs will start in, and when they are
+    // predicted to finish
+    void print_plan(
+        const std::vector<std::pair<const Job *, int64_t>>
+            &_order);
+
+    // Guards `log` and `stats` while commands run concurrently
+    std::mutex record_mutex;
+
+    // Servers by builder name. Another copy is started
+    // whenever every one is busy, so up to one per worker. A
+    // server which failed to start or has died has a negative
+    // pid, and stops its builder using servers.
+    std::map<std::string, std::list<Server>> servers;
+    std::mutex servers_mutex;
+    Server *take_server(const Job &_job);
+
+    // Run a job in an idle server, or nothing if its builder's
+    // servers are dead
+    std::optional<CommandOutput> run_in_server(const Job &_job);
+
+    // Where the next child pinned by core count starts
+    std::atomic<uint64_t> next_cpu = 0;
+
+    // The CPUs a job's commands are pinned to, if any
+    bool job_cpus(const Job &_job, cpu_set_t &_into);
+
+    // Run the given shell command and get its output. The
+    // command's stdout is captured, and fd 3 is provided to it
+    // as the framing channel. If run for a job, the job's
+    // scratch directory is passed as `JKNIT_SCRATCH` and its
+    // builder's limits are applied. When each command ran is
+    // kept in `busy`, and overlapping commands count once.
+    std::vector<std::pair<
+        std::chrono::high_resolution_clock::time_point,
+        std::chrono::high_resolution_clock::time_point>>
+        busy;
+    CommandOutput run_and_get_output(const std::string &_cmd,
+                                     const Job *_job = nullptr);
+
+    // The two halves of `run_and_get_output`. With `_input`,
+    // the command's stdin is a pipe which the caller must
+    // close before collecting.
+    Child spawn(const std::string &_cmd, const Job *_job,
+                const bool _input = false);
+    CommandOutput collect(const std::string &_cmd,
+                          Child &_child, const Job *_job);
+
+    // Sessions whose interpreters were started early, by
+    // language, along with their commands and scratch dirs
+    struct Prewarmed
+    {
+        std::string command, scratch;
+        Child child;
+    };
+    std::map<std::string, Prewarmed> prewarmed;
+    void prewarm(const std::string &_lang);
+    CommandOutput feed(Prewarmed &_session, const Job &_job);
+
+    // Whether a builder's sessions are run by its `checkpoint`
+    bool checkpointing(const Builder &_builder) const;
+
+    // Run each of a session's chunks in its checkpointed
+    // interpreter, resuming from the latest copy still of use,
+    // and get the output of each
+    std::queue<Chunk> run_checkpointed(
+        const std::string &_lang,
+        const std::vector<std::list<std::string>> &_chunks);
+    bool resume(Checkpointed &_session,
+                const uint64_t _changed);
+    void evict_copies();
+
+    // Log a command's output and count it towards the stats
+    void record_output(const std::string &_cmd,
+                       const CommandOutput &_out);
+
+    // Break a single command's output into multiple chunks,
+    // either by its framing records or by "CHUNK_BREAK" lines
+    std::queue<Chunk> break_output_chunk(
+        const CommandOutput &_output);
+
+    // Split jmd into raw text/code chunks
+    std::list<Chunk> scan_chunks(std::istream &_from);
+
+    // Get the (possibly cached) raw chunks of a jmd file
+    std::shared_ptr<const std::list<Chunk>> load_fragment(
+        const std::string &_path);
+
+    // Append chunks read from the file `_from` to `_into`,
+    // loading settings and splicing in includes
+    void splice_chunks(const std::list<Chunk> &_chunks,
+                       const std::string &_from,
+                       std::list<Chunk> &_into);
+
+    // With `settings.section`: The level of its heading once
+    // found (else 0), and whether a later heading has ended it.
+    // Splicing stops at its end.
+    uint64_t section_level = 0;
+    bool section_ended = false;
+    bool in_section() const;
+    void split_section(const Chunk &_text,
+                       std::list<Chunk> &_into);
+
+    // The files currently being spliced, outermost first
+    std::list<std::string> include_stack;
+    void include_file(const std::filesystem::path &_path,
+                      std::list<Chunk> &_into);
 
     // Go through the input, extract code from `jmd` to output.
     // This creates a list of text/code chunks which should then
     // be constructed into output.
     std::list<Chunk> parse();
 
+    // Knits into this target and those of `_others`
+    void knit_all(const std::list<Chunk> &_chunks,
+                  const std::list<Engine *> &_others);
+
     // Constructs a series of text/code chunks into the output
     // file. This is abstract, as the specific language
     // targetted may vary.
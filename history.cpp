@@ -0,0 +1,177 @@
+/*
+Jordan Dehmel
+2023 - present
+*/
+
+#include "history.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <ios>
+#include <sstream>
+#include <sys/file.h>
+#include <unistd.h>
+#include <vector>
+
+uint64_t hash_lines(const std::list<std::string> &_lines,
+                    uint64_t _hash)
+{
+    for (const auto &line : _lines)
+    {
+        for (const auto c : line)
+        {
+            _hash = (_hash ^ (uint8_t)c) * 0x100000001b3ull;
+        }
+        _hash = (_hash ^ (uint8_t)'\n') * 0x100000001b3ull;
+    }
+    return _hash;
+}
+
+std::string cache_path(const std::string &_name)
+{
+    if (getenv("XDG_CACHE_HOME") != nullptr)
+    {
+        return std::string(getenv("XDG_CACHE_HOME")) +
+               "/jknit/" + _name;
+    }
+    else if (getenv("HOME") != nullptr)
+    {
+        return std::string(getenv("HOME")) + "/.cache/jknit/" +
+               _name;
+    }
+    return "";
+}
+
+History::History()
+{
+    path = cache_path("history");
+    if (!path.empty())
+    {
+        read(path, entries);
+    }
+}
+
+// Each line is a hex key, then compile and run microseconds,
+// then when it last ran. Lines without the last are taken to
+// be from long ago.
+void History::read(const std::string &_path,
+                   std::map<uint64_t, Timing> &_into)
+{
+    std::ifstream f(_path);
+    std::string line;
+    while (getline(f, line))
+    {
+        std::stringstream fields(line);
+        uint64_t key;
+        Timing timing;
+        if (fields >> std::hex >> key >> std::dec >>
+            timing.compile_us >> timing.run_us)
+        {
+            fields >> timing.used;
+            _into[key] = timing;
+        }
+    }
+}
+
+bool History::lookup(const uint64_t _key, Timing &_into) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = entries.find(_key);
+    if (it == entries.end())
+    {
+        return false;
+    }
+
+    _into = it->second;
+    return true;
+}
+
+void History::record(const uint64_t _key, const Timing &_timing)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    updated[_key] = _timing;
+    updated[_key].used =
+        std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+}
+
+void History::save()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (path.empty() || updated.empty())
+    {
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(
+        std::filesystem::path(path).parent_path(), ec);
+
+    // Concurrent runs take turns, so neither's timings are
+    // lost. The history is only a hint, so without the lock
+    // nothing is saved.
+    const int lock_fd = open((path + ".lock").c_str(),
+                             O_WRONLY | O_CREAT | O_CLOEXEC,
+                             0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0)
+    {
+        if (lock_fd >= 0)
+        {
+            close(lock_fd);
+        }
+        return;
+    }
+
+    // Another run may have saved since this one loaded
+    std::map<uint64_t, Timing> merged;
+    read(path, merged);
+    for (const auto &[key, timing] : updated)
+    {
+        merged[key] = timing;
+    }
+
+    // Keep the most recently run, so that chunks which have
+    // been edited or deleted do not pile up
+    const uint64_t now =
+        std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    std::vector<std::pair<uint64_t, uint64_t>> by_use;
+    for (const auto &[key, timing] : merged)
+    {
+        by_use.emplace_back(timing.used, key);
+    }
+    std::sort(by_use.rbegin(), by_use.rend());
+    for (uint64_t i = 0; i < by_use.size(); ++i)
+    {
+        const auto [used, key] = by_use[i];
+        if (i >= MAX_ENTRIES || used + MAX_AGE_S < now)
+        {
+            merged.erase(key);
+        }
+    }
+
+    const auto temp =
+        path + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream f(temp);
+    for (const auto &[key, timing] : merged)
+    {
+        f << std::hex << key << std::dec << ' '
+          << timing.compile_us << ' ' << timing.run_us << ' '
+          << timing.used << '\n';
+    }
+    f.close();
+    if (f)
+    {
+        std::filesystem::rename(temp, path, ec);
+    }
+    else
+    {
+        std::filesystem::remove(temp, ec);
+    }
+    close(lock_fd);
+}
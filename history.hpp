@@ -0,0 +1,59 @@
+/*
+A small on-disk record of how long past chunks took to compile
+and run, keyed by a hash of their code and builder. It is used
+to schedule the longest work first.
+Jordan Dehmel
+2023 - present
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+// How long one chunk or session took last time it ran, and
+// when that was (in seconds since the epoch)
+struct Timing
+{
+    uint64_t compile_us = 0, run_us = 0, used = 0;
+};
+
+// The given file under `$XDG_CACHE_HOME/jknit` (or the same
+// under `~/.cache`), or nothing if neither is set
+std::string cache_path(const std::string &_name);
+
+// FNV-1a over the given strings, each followed by a newline
+uint64_t hash_lines(const std::list<std::string> &_lines,
+                    uint64_t _hash = 0xcbf29ce484222325ull);
+
+class History
+{
+  public:
+    // Loads `$XDG_CACHE_HOME/jknit/history` (or the same under
+    // `~/.cache`). Without either, nothing is remembered.
+    History();
+
+    // Whether there is a past timing for the given key
+    bool lookup(const uint64_t _key, Timing &_into) const;
+
+    // Remember a new timing, to be written by `save`
+    void record(const uint64_t _key, const Timing &_timing);
+
+    // Merge new timings into the file on disk, atomically and
+    // under a lock, dropping those of chunks not run for
+    // `MAX_AGE_S` and the oldest beyond `MAX_ENTRIES`
+    void save();
+    const static uint64_t MAX_AGE_S = 90 * 24 * 60 * 60;
+    const static uint64_t MAX_ENTRIES = 16384;
+
+  protected:
+    std::string path;
+    std::map<uint64_t, Timing> entries, updated;
+    mutable std::mutex mutex;
+
+    static void read(const std::string &_path,
+                     std::map<uint64_t, Timing> &_into);
+};
@@ -0,0 +1,264 @@
+/*
+Jordan Dehmel
+2023 - present
+*/
+
+#include "logger.hpp"
+#include <chrono>
+#include <cinttypes>
+
+const static std::string LEVELS[] = {"error", "warn", "info",
+                                     "debug"};
+
+bool parse_log_level(const std::string &_name, LogLevel &_into)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        if (LEVELS[i] == _name)
+        {
+            _into = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::string json_string(std::string_view _text)
+{
+    std::string out = "\"";
+    for (const auto c : _text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else if (c == '\t')
+        {
+            out += "\\t";
+        }
+        else if ((uint8_t)c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x",
+                     (unsigned)c);
+            out += escaped;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+// A string, or for long ones its start, size and hash
+static std::string json_value(std::string_view _value)
+{
+    if (_value.size() <= LOG_PAYLOAD_LIMIT)
+    {
+        return json_string(_value);
+    }
+
+    // FNV-1a, which tells apart (or matches up) payloads which
+    // begin the same way
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const auto c : _value)
+    {
+        hash = (hash ^ (uint8_t)c) * 0x100000001b3ull;
+    }
+    char hex[24];
+    snprintf(hex, sizeof(hex), "%016" PRIx64, hash);
+
+    return "{\"head\":" +
+           json_string(_value.substr(0, LOG_PAYLOAD_LIMIT)) +
+           ",\"bytes\":" + std::to_string(_value.size()) +
+           ",\"fnv\":\"" + hex + "\"}";
+}
+
+Logger::~Logger()
+{
+    close();
+}
+
+bool Logger::open(const std::string &_path,
+                  const LogLevel _level)
+{
+    close();
+    file = fopen(_path.c_str(), "w");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    slots = std::make_unique<Slot[]>(CAPACITY);
+    for (uint64_t i = 0; i < CAPACITY; ++i)
+    {
+        slots[i].sequence = i;
+    }
+    head = tail = 0;
+    stopping = false;
+    threshold = (int)_level;
+    writer = std::thread([this]() { run_writer(); });
+    return true;
+}
+
+void Logger::write(const LogLevel _level,
+                   std::string_view _event,
+                   std::initializer_list<LogField> _fields)
+{
+    if (!enabled(_level))
+    {
+        return;
+    }
+
+    // Check again once counted, as `close` may have begun
+    writing.fetch_add(1);
+    if ((int)_level > threshold.load())
+    {
+        done_writing();
+        return;
+    }
+
+    const uint64_t now =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    char ts[32];
+    snprintf(ts, sizeof(ts), "%" PRIu64 ".%06" PRIu64,
+             now / 1000000, now % 1000000);
+
+    std::string line = std::string("{\"ts\":") + ts +
+                       ",\"level\":\"" + LEVELS[(int)_level] +
+                       "\",\"event\":" + json_string(_event);
+    for (const auto &field : _fields)
+    {
+        line += ',';
+        line += json_string(field.key);
+        line += ':';
+        line += field.json.empty() ? json_value(field.text)
+                                   : field.json;
+    }
+    line += "}\n";
+
+    push(std::move(line));
+    done_writing();
+}
+
+void Logger::done_writing()
+{
+    if (writing.fetch_sub(1) == 1)
+    {
+        writing.notify_all();
+    }
+}
+
+// Claim the next slot by bumping `head`, fill it, then publish
+// it by bumping its sequence. If the writer has fallen a whole
+// ring behind, wait for it rather than drop records.
+void Logger::push(std::string &&_line)
+{
+    auto position = head.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true)
+    {
+        slot = &slots[position % CAPACITY];
+        const auto sequence =
+            slot->sequence.load(std::memory_order_acquire);
+        if (sequence == position)
+        {
+            if (head.compare_exchange_weak(
+                    position, position + 1,
+                    std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (sequence < position)
+        {
+            std::this_thread::yield();
+            position = head.load(std::memory_order_relaxed);
+        }
+        else
+        {
+            position = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->line = std::move(_line);
+    slot->sequence.store(position + 1,
+                         std::memory_order_release);
+    pushed.fetch_add(1, std::memory_order_release);
+    pushed.notify_one();
+}
+
+// Only ever called by the writer
+bool Logger::pop(std::string &_into)
+{
+    auto &slot = slots[tail % CAPACITY];
+    const auto sequence =
+        slot.sequence.load(std::memory_order_acquire);
+    if (sequence != tail + 1)
+    {
+        return false;
+    }
+
+    _into = std::move(slot.line);
+    slot.sequence.store(tail + CAPACITY,
+                        std::memory_order_release);
+    ++tail;
+    return true;
+}
+
+void Logger::run_writer()
+{
+    std::string line;
+    while (true)
+    {
+        const auto seen =
+            pushed.load(std::memory_order_acquire);
+        while (pop(line))
+        {
+            fwrite(line.data(), 1, line.size(), file);
+        }
+        fflush(file);
+
+        if (stopping)
+        {
+            // Anything pushed before stopping is in by now
+            while (pop(line))
+            {
+                fwrite(line.data(), 1, line.size(), file);
+            }
+            return;
+        }
+        pushed.wait(seen, std::memory_order_acquire);
+    }
+}
+
+void Logger::close()
+{
+    if (file == nullptr)
+    {
+        return;
+    }
+
+    // No new records get past the level check after this, so
+    // once those already past it are pushed, the ring is whole
+    threshold = -1;
+    for (auto n = writing.load(); n != 0; n = writing.load())
+    {
+        writing.wait(n);
+    }
+    stopping = true;
+    pushed.fetch_add(1, std::memory_order_release);
+    pushed.notify_one();
+    writer.join();
+
+    fclose(file);
+    file = nullptr;
+}
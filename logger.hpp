@@ -0,0 +1,117 @@
+/*
+Structured logging for JKnit's `-l` flag. Each record is a line
+of JSON, formatted by the thread logging it and written to the
+log file by a background thread. Records pass between them
+through a fixed-size lock-free ring buffer, so no thread waits
+on the file.
+Jordan Dehmel
+2023 - present
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+enum class LogLevel
+{
+    error,
+    warn,
+    info,
+    debug
+};
+
+// Parse "error", "warn", "info" or "debug"
+bool parse_log_level(const std::string &_name, LogLevel &_into);
+
+// Strings longer than this are logged as their first this many
+// bytes, their full size and their hash
+const static uint64_t LOG_PAYLOAD_LIMIT = 4096;
+
+// One `"key": value` pair of a record. Strings are only viewed
+// here, and encoded by `Logger::write` if the record is kept.
+struct LogField
+{
+    std::string_view key, text;
+    std::string json;
+
+    LogField(std::string_view _key, std::string_view _value)
+        : key(_key), text(_value)
+    {
+    }
+
+    template <typename T>
+        requires std::is_arithmetic_v<T>
+    LogField(std::string_view _key, const T _value) : key(_key)
+    {
+        if constexpr (std::is_same_v<T, bool>)
+        {
+            json = _value ? "true" : "false";
+        }
+        else
+        {
+            json = std::to_string(_value);
+        }
+    }
+};
+
+class Logger
+{
+  public:
+    ~Logger();
+
+    // Start writing records at or below `_level` to the given
+    // file, replacing it
+    bool open(const std::string &_path, const LogLevel _level);
+
+    // Whether records of this level are written. Check this
+    // before building expensive fields.
+    bool enabled(const LogLevel _level) const
+    {
+        return (int)_level <=
+               threshold.load(std::memory_order_relaxed);
+    }
+
+    void write(const LogLevel _level, std::string_view _event,
+               std::initializer_list<LogField> _fields = {});
+
+    // Write every queued record and stop
+    void close();
+
+  protected:
+    // A slot is free for the push numbered `sequence`, or holds
+    // a record for the pop numbered `sequence - 1`
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence;
+        std::string line;
+    };
+    const static uint64_t CAPACITY = 1024;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> head = 0;
+    uint64_t tail = 0;
+
+    // Bumped on every push (and on closing) to wake the writer
+    std::atomic<uint64_t> pushed = 0;
+    std::atomic<bool> stopping = false;
+
+    // Calls to `write` past the level check, which closing
+    // waits out so that their records are not lost
+    std::atomic<uint64_t> writing = 0;
+
+    std::atomic<int> threshold = -1;
+    FILE *file = nullptr;
+    std::thread writer;
+
+    void push(std::string &&_line);
+    void done_writing();
+    bool pop(std::string &_into);
+    void run_writer();
+};
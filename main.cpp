@@ -6,17 +6,50 @@ Jordan Dehmel
 
 #include "engine.hpp"
 #include "md_engine.hpp"
+#include "metrics.hpp"
 #include "tex_engine.hpp"
+#include <algorithm>
+#include <charconv>
 #include <chrono>
+#include <csignal>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <list>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
 static_assert(__cplusplus >= 2020'00UL);
 
+// Python's chunk break is sent over the framing channel, so
+// sessions which print "CHUNK_BREAK" themselves are not split
+const static std::string py_break =
+    "'__import__(\"sys\").stdout.flush();"
+    "__import__(\"os\").write(3,b\"%d\\n\"%"
+    "__import__(\"os\").lseek(1,0,1))'";
+
+// Python sessions start up while the source is still being
+// parsed, and read their code from stdin. Inline spans print
+// their values. Under `--watch`, sessions are checkpointed.
+const static std::string py_attributes =
+    "prewarm='/bin/python3 -' inline='print(%)' "
+    "checkpoint=/usr/include/compilation-drivers/"
+    "py_checkpoint.py";
+
+// C and C++ chunks built as shared objects, which a host
+// process loads and calls instead of running each as a program
+const static std::string so_host =
+    "/usr/include/compilation-drivers/so_host";
+const static std::string so_attributes =
+    " -shared -fPIC % -o @' run='" + so_host + " @' server=" +
+    so_host;
+
 void load_engine(Engine &_e,
                  const std::list<std::string> &_settings_files)
 {
@@ -26,61 +59,308 @@ void load_engine(Engine &_e,
     }
 
     // Interpreted languages
+    _e.load_settings_line("py /bin/python3 " + py_break +
+                          " py " + py_attributes);
     _e.load_settings_line(
-        "py /bin/python3 'print(\"CHUNK_BREAK\")' py");
-    _e.load_settings_line(
-        "octave octave 'printf(\"CHUNK_BREAK\\n\");' m");
-    _e.load_settings_line(
-        "bash /usr/bin/sh 'echo CHUNK_BREAK' sh");
+        "octave octave 'printf(\"CHUNK_BREAK\\n\");' m "
+        "prewarm='octave --no-gui --quiet' inline='disp(%)'");
+    _e.load_settings_line("bash /usr/bin/sh 'echo CHUNK_BREAK' "
+                          "sh inline='echo %'");
     _e.load_settings_line(
         "js node 'console.log('CHUNK_BREAK');' js");
-    _e.load_settings_line("r R 'print(\"CHUNK_BREAK\")' R");
+    _e.load_settings_line("r R 'print(\"CHUNK_BREAK\")' R "
+                          "prewarm='R --no-save --no-echo'");
 
     // Compiled languages
-    _e.load_settings_line("clangpp "
-                          "/usr/include/compilation-drivers/"
-                          "clangpp_driver.py ; cpp");
-    _e.load_settings_line(
-        "gpp /usr/include/compilation-drivers/gpp_driver.py ; "
-        "cpp");
     _e.load_settings_line(
-        "clang "
-        "/usr/include/compilation-drivers/clang_driver.py ; c");
+        "clangpp clang++ ; cpp compile='clang++ % -o @'");
+    _e.load_settings_line("gpp g++ ; cpp compile='g++ % -o @'");
     _e.load_settings_line(
-        "gcc /usr/include/compilation-drivers/gcc_driver.py ; "
-        "c");
+        "clang clang ; c compile='clang % -o @'");
+    _e.load_settings_line("gcc gcc ; c compile='gcc % -o @'");
     _e.load_settings_line(
-        "rust /usr/include/compilation-drivers/rustc_driver.py "
-        "; rs");
+        "rust rustc ; rs compile='rustc % -o @'");
     _e.load_settings_line(
-        "oak /usr/include/compilation-drivers/acorn_driver.py "
-        "'' oak");
+        "oak acorn '' oak compile='acorn -Me % -o @'");
+    _e.load_settings_line("cppso g++ ; cpp compile='g++" +
+                          so_attributes);
+    _e.load_settings_line("cso gcc ; c compile='gcc" +
+                          so_attributes);
 
     // Aliases
-    _e.load_settings_line(
-        "cpp /usr/include/compilation-drivers/gpp_driver.py ; "
-        "cpp");
-    _e.load_settings_line(
-        "cxx /usr/include/compilation-drivers/gpp_driver.py ; "
-        "cpp");
-    _e.load_settings_line(
-        "c /usr/include/compilation-drivers/gcc_driver.py ; c");
-    _e.load_settings_line(
-        "python /bin/python3 'print(\"CHUNK_BREAK\")' py");
-    _e.load_settings_line(
-        "python3 /bin/python3 'print(\"CHUNK_BREAK\")' py");
+    _e.load_settings_line("cpp g++ ; cpp compile='g++ % -o @'");
+    _e.load_settings_line("cxx g++ ; cpp compile='g++ % -o @'");
+    _e.load_settings_line("c gcc ; c compile='gcc % -o @'");
+    _e.load_settings_line("python /bin/python3 " + py_break +
+                          " py " + py_attributes);
+    _e.load_settings_line("python3 /bin/python3 " + py_break +
+                          " py " + py_attributes);
+}
+
+// Escape a path for use in a make rule
+std::string make_escape(const std::string &_path)
+{
+    std::string out;
+    for (const auto ch : _path)
+    {
+        if (ch == ' ' || ch == '#' || ch == ':')
+        {
+            out += '\\';
+        }
+        else if (ch == '$')
+        {
+            out += '$';
+        }
+        out += ch;
+    }
+    return out;
+}
+
+// Write a make rule saying that every target depends on every
+// file that was read, plus an empty rule for each of those so
+// that deleting one does not break the build
+void write_depfile(const std::string &_path,
+                   const std::list<std::string> &_targets,
+                   const std::list<std::string> &_dependencies)
+{
+    std::ofstream f(_path);
+    if (!f.is_open())
+    {
+        throw std::runtime_error("Failed to open depfile '" +
+                                 _path + "'");
+    }
+
+    for (const auto &target : _targets)
+    {
+        f << make_escape(target) << ' ';
+    }
+    f << ':';
+    for (const auto &dependency : _dependencies)
+    {
+        f << " \\\n " << make_escape(dependency);
+    }
+    f << '\n';
+
+    for (const auto &dependency : _dependencies)
+    {
+        f << '\n' << make_escape(dependency) << ":\n";
+    }
+}
+
+// Count a failed run in the metrics file, if there is one
+void count_failed_run(const std::string &_metrics_file)
+{
+    if (_metrics_file.empty())
+    {
+        return;
+    }
+
+    try
+    {
+        write_metrics(_metrics_file, nullptr);
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cerr << "ERROR: " << e.what() << '\n';
+    }
+}
+
+// Knit the source into every target once, returning the exit
+// code. `_dependencies` is set to the files read if successful.
+static int knit(const Settings &_settings,
+                const std::list<std::string> &_settings_files,
+                const std::list<std::string> &_targets,
+                const bool _target_tex,
+                const std::string &_depfile,
+                const std::string &_metrics_file,
+                std::list<std::string> &_dependencies)
+{
+    RunStats stats;
+
+    // Generate loader objects: One per target, but only the
+    // first one ever executes any code
+    // Run engine and save to file(s)
+    try
+    {
+        std::list<std::unique_ptr<Engine>> engines;
+        std::list<Engine *> others;
+        for (const auto &target : _targets)
+        {
+            Settings target_settings = _settings;
+            target_settings.target = target;
+            if (!engines.empty())
+            {
+                // Only the executing engine logs
+                target_settings.log = false;
+            }
+
+            if (_target_tex || target.ends_with(".tex"))
+            {
+                engines.push_back(
+                    std::make_unique<TEXEngine>(
+                        target_settings));
+            }
+            else
+            {
+                if (!target.ends_with(".md"))
+                {
+                    std::cerr << "WARNING: Unknown target file "
+                              << "extension on '" << target
+                              << "'; Target language will be "
+                              << "markdown\n";
+                }
+                engines.push_back(
+                    std::make_unique<MDEngine>(
+                        target_settings));
+            }
+
+            if (engines.size() > 1)
+            {
+                others.push_back(engines.back().get());
+            }
+        }
+
+        load_engine(*engines.front(), _settings_files);
+        stats = engines.front()->run(others);
+        _dependencies = engines.front()->get_dependencies();
+
+        if (!_depfile.empty())
+        {
+            write_depfile(_depfile, _targets,
+                          engines.front()->get_dependencies());
+        }
+
+        if (!_metrics_file.empty())
+        {
+            write_metrics(_metrics_file, &stats);
+        }
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cerr << "ERROR: " << e.what() << '\n'
+                  << "(knitting halted)\n";
+        count_failed_run(_metrics_file);
+        return 2;
+    }
+    catch (...)
+    {
+        std::cerr << "UNKNOWN ERROR\n"
+                  << "(knitting halted)\n";
+        count_failed_run(_metrics_file);
+        return 3;
+    }
+
+    if (_settings.time)
+    {
+        const auto total_us = std::chrono::duration_cast<
+                                  std::chrono::microseconds>(
+                                  stats.stop - stats.start)
+                                  .count();
+        // Overlapping commands count once, but clamp anyway
+        const auto jknit_us = std::max<int64_t>(
+            0, total_us - (int64_t)stats.external_us);
+        const double percent_jknit =
+            100.0 * (double)(jknit_us) / (double)(total_us);
+        const double percent_extern = 100.0 - percent_jknit;
+
+        std::cout << "Total us:                   " << total_us
+                  << '\n'
+                  << "JKnit-attributable us:      " << jknit_us
+                  << '\n'
+                  << "Non-JKnit us:               "
+                  << total_us - jknit_us << '\n'
+                  << "Percent JKnit-attributable: "
+                  << percent_jknit << '\n'
+                  << "Percent Non-JKnit:          "
+                  << percent_extern << '\n';
+
+        std::cout << "\nPhase   | us         | Allocs     | "
+                  << "Bytes      | Peak RSS KB\n";
+        for (const auto &name : PHASES)
+        {
+            const auto phase = stats.phases[name];
+            std::cout << std::left << std::setw(8) << name
+                      << "| " << std::setw(11) << phase.us
+                      << "| " << std::setw(11)
+                      << phase.allocations << "| "
+                      << std::setw(11) << phase.bytes << "| "
+                      << phase.peak_rss_kb << '\n';
+        }
+
+        std::cout << "\nChild us   | Max RSS KB | Command\n";
+        for (const auto &child : stats.children)
+        {
+            std::cout << std::left << std::setw(11) << child.us
+                      << "| " << std::setw(11)
+                      << child.max_rss_kb << "| "
+                      << child.command << '\n';
+        }
+    }
+
+    return 0;
+}
+
+// A signal kills any running commands and fails the knit (or
+// stops watching), so that scratch directories, temp targets
+// and checkpointed sessions are cleaned up on the way out.
+// Repeats are ignored, as they often come in pairs (as from
+// `timeout`, which signals both JKnit and its group).
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void interrupt(int _signal)
+{
+    if (interrupted == 0)
+    {
+        interrupted = _signal;
+        interrupt_commands();
+    }
+}
+
+// Wait until any of the given files has been written to since
+// `_since`, returning false if interrupted first. A file
+// which is briefly missing (as while an editor replaces it)
+// is checked again next time.
+static bool wait_for_change(
+    const std::list<std::string> &_paths,
+    const std::filesystem::file_time_type _since)
+{
+    while (interrupted == 0)
+    {
+        for (const auto &path : _paths)
+        {
+            std::error_code ec;
+            const auto mtime =
+                std::filesystem::last_write_time(path, ec);
+            if (!ec && mtime >= _since)
+            {
+                return true;
+            }
+        }
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(250));
+    }
+    return false;
+}
+
+// Parse a whole, non-negative number, rejecting anything else
+// (such as a typo which `strtoull` would quietly read as 0)
+static bool parse_count(const char *_text, uint64_t &_into)
+{
+    const auto end = _text + strlen(_text);
+    const auto result = std::from_chars(_text, end, _into);
+    return result.ec == std::errc() && result.ptr == end &&
+           result.ptr != _text;
 }
 
 int main(int c, char *v[])
 {
     Settings settings;
-    std::list<std::string> settings_files;
-    RunStats stats;
+    std::list<std::string> settings_files, targets;
+    std::string depfile, metrics_file;
     bool target_tex = false;
     settings.log = settings.time = settings.all_errors =
         settings.forceFancyFonts = false;
     settings.source = "";
-    settings.target = "a.md";
 
     // Parse CLI input
     std::string arg;
@@ -88,8 +368,113 @@ int main(int c, char *v[])
     {
         arg = v[cur_arg];
 
+        // Handle long flag
+        if (arg.starts_with("--"))
+        {
+            if (arg == "--plan")
+            {
+                settings.plan = true;
+            }
+            else if (arg == "--metrics-file")
+            {
+                ++cur_arg;
+                if (cur_arg >= c)
+                {
+                    std::cerr << "'--metrics-file' must not be "
+                              << "last arg.\n";
+                    return 1;
+                }
+                metrics_file = v[cur_arg];
+                settings.metrics = true;
+            }
+            else if (arg == "--watch")
+            {
+                settings.watch = true;
+            }
+            else if (arg == "--checkpoint-mb")
+            {
+                ++cur_arg;
+                if (cur_arg >= c)
+                {
+                    std::cerr << "'--checkpoint-mb' must not "
+                              << "be last arg.\n";
+                    return 1;
+                }
+                if (!parse_count(v[cur_arg],
+                                 settings.checkpoint_mb))
+                {
+                    std::cerr << "'--checkpoint-mb' takes a "
+                              << "number of MB.\n";
+                    return 1;
+                }
+            }
+            else if (arg == "--section")
+            {
+                ++cur_arg;
+                if (cur_arg >= c)
+                {
+                    std::cerr << "'--section' must not be "
+                              << "last arg.\n";
+                    return 1;
+                }
+                settings.section = v[cur_arg];
+            }
+            else if (arg == "--externalize")
+            {
+                ++cur_arg;
+                if (cur_arg >= c)
+                {
+                    std::cerr << "'--externalize' must not be "
+                              << "last arg.\n";
+                    return 1;
+                }
+                if (!parse_count(v[cur_arg],
+                                 settings.externalize_lines))
+                {
+                    std::cerr << "'--externalize' takes a "
+                              << "number of lines.\n";
+                    return 1;
+                }
+            }
+            else if (arg == "--log-file")
+            {
+                ++cur_arg;
+                if (cur_arg >= c)
+                {
+                    std::cerr << "'--log-file' must not be "
+                              << "last arg.\n";
+                    return 1;
+                }
+                settings.log_file = v[cur_arg];
+                settings.log = true;
+            }
+            else if (arg == "--log-level")
+            {
+                ++cur_arg;
+                if (cur_arg >= c)
+                {
+                    std::cerr << "'--log-level' must not be "
+                              << "last arg.\n";
+                    return 1;
+                }
+                else if (!parse_log_level(v[cur_arg],
+                                          settings.log_level))
+                {
+                    std::cerr << "Unrecognized log level '"
+                              << v[cur_arg] << "'\n";
+                    return 1;
+                }
+                settings.log = true;
+            }
+            else
+            {
+                std::cerr << "Unrecognized flag '" << arg
+                          << "'\n";
+            }
+        }
+
         // Handle normal flag
-        if (arg.front() == '-')
+        else if (arg.front() == '-')
         {
             for (uint64_t i = 1; i < arg.size(); ++i)
             {
@@ -106,6 +491,17 @@ int main(int c, char *v[])
                     }
                     std::filesystem::current_path(v[cur_arg]);
                     break;
+                case 'd': // Depfile
+                case 'D':
+                    ++cur_arg;
+                    if (cur_arg >= c)
+                    {
+                        std::cerr << "'-d' must not be last "
+                                  << "arg.\n";
+                        return 1;
+                    }
+                    depfile = v[cur_arg];
+                    break;
                 case 'e': // Warnings to errors
                 case 'E':
                     settings.all_errors = !settings.all_errors;
@@ -129,22 +525,50 @@ int main(int c, char *v[])
                         << "code\n\n"
                         << "CLI flags (case-independent):\n"
                         << "-c Change working directory\n"
+                        << "-d Write make depfile\n"
                         << "-e Warnings to errors\n"
                         << "-f Load settings file\n"
                         << "-h Help (this)\n"
-                        << "-l Toggle log (default off)\n"
-                        << "-o Set output file\n"
+                        << "-j Max chunks to run at once\n"
+                        << "-l Turn on log (default off)\n"
+                        << "-o Add output file (repeatable)\n"
                         << "-q Quit without error\n"
                         << "-t Toggle timer (default off)\n"
                         << "-v Version\n"
                         << "-x Force TeX mode\n"
+                        << "--plan Print predicted schedule\n"
+                        << "--metrics-file Add to Prometheus "
+                        << "textfile\n"
+                        << "--watch Knit again on changes\n"
+                        << "--checkpoint-mb Memory for "
+                        << "session copies\n"
+                        << "--section Knit only this "
+                        << "section\n"
+                        << "--externalize Move longer tex "
+                        << "blocks to files\n"
+                        << "--log-file Log to this file\n"
+                        << "--log-level Log error, warn, "
+                        << "info or debug\n"
                         << '\n'
                         << "Jordan Dehmel, 2023 - present\n"
                         << "MIT license\n";
                     break;
+                case 'j': // Parallel jobs
+                case 'J':
+                    ++cur_arg;
+                    if (cur_arg >= c)
+                    {
+                        std::cerr << "'-j' must not be last "
+                                  << "arg.\n";
+                        return 1;
+                    }
+                    settings.jobs = std::max<uint64_t>(
+                        1,
+                        std::strtoull(v[cur_arg], nullptr, 10));
+                    break;
                 case 'l': // Log
                 case 'L':
-                    settings.log = !settings.log;
+                    settings.log = true;
                     break;
                 case 'o': // Set target
                 case 'O':
@@ -155,7 +579,7 @@ int main(int c, char *v[])
                                   << "arg.\n";
                         return 1;
                     }
-                    settings.target = v[cur_arg];
+                    targets.push_back(v[cur_arg]);
                     break;
                 case 'q': // Quit w/o error
                 case 'Q':
@@ -206,73 +630,49 @@ int main(int c, char *v[])
         }
     }
 
-    if (settings.target.ends_with(".tex"))
-    {
-        target_tex = true;
-    }
-    else if (!target_tex && !settings.target.ends_with(".md"))
+    if (targets.empty())
     {
-        std::cerr << "WARNING: Unknown target file extension; "
-                  << "Target language will be markdown\n";
+        targets.push_back(target_tex ? "a.tex" : "a.md");
     }
 
-    if (target_tex && settings.target == "a.md")
+    // Under `--watch`, knit again whenever a file read by the
+    // last successful knit changes, until interrupted
+    std::list<std::string> dependencies = settings_files;
+    dependencies.push_back(settings.source);
+
+    // Writing to a dead interpreter, server or checkpoint
+    // driver then fails rather than killing jknit. Commands are
+    // given back the default.
+    std::signal(SIGPIPE, SIG_IGN);
+    for (const int sig : {SIGINT, SIGTERM, SIGHUP})
     {
-        settings.target = "a.tex";
+        // Signals ignored already (as under `nohup`) stay so
+        if (std::signal(sig, interrupt) == SIG_IGN)
+        {
+            std::signal(sig, SIG_IGN);
+        }
     }
-
-    // Generate loader object
-    // Run engine and save to file
-    try
+    while (true)
     {
-        if (target_tex)
+        const auto started =
+            std::filesystem::file_time_type::clock::now();
+        const int status =
+            knit(settings, settings_files, targets, target_tex,
+                 depfile, metrics_file, dependencies);
+        if (interrupted != 0)
         {
-            TEXEngine e(settings);
-            load_engine(e, settings_files);
-            stats = e.run();
+            return 128 + interrupted;
         }
-        else
+        else if (!settings.watch)
         {
-            MDEngine e(settings);
-            load_engine(e, settings_files);
-            stats = e.run();
+            return status;
         }
-    }
-    catch (std::runtime_error &e)
-    {
-        std::cerr << "ERROR: " << e.what() << '\n'
-                  << "(knitting halted)\n";
-        return 2;
-    }
-    catch (...)
-    {
-        std::cerr << "UNKNOWN ERROR\n"
-                  << "(knitting halted)\n";
-        return 3;
-    }
-
-    if (settings.time)
-    {
-        const auto total_us = std::chrono::duration_cast<
-                                  std::chrono::microseconds>(
-                                  stats.stop - stats.start)
-                                  .count();
-        const auto jknit_us = total_us - stats.external_us;
-        const double percent_jknit =
-            100.0 * (double)(jknit_us) / (double)(total_us);
-        const double percent_extern = 100.0 - percent_jknit;
 
-        std::cout << "Total us:                   " << total_us
-                  << '\n'
-                  << "JKnit-attributable us:      " << jknit_us
-                  << '\n'
-                  << "Non-JKnit us:               "
-                  << total_us - jknit_us << '\n'
-                  << "Percent JKnit-attributable: "
-                  << percent_jknit << '\n'
-                  << "Percent Non-JKnit:          "
-                  << percent_extern << '\n';
+        std::cout << "Watching for changes (^C to stop)\n"
+                  << std::flush;
+        if (!wait_for_change(dependencies, started))
+        {
+            return 128 + interrupted;
+        }
     }
-
-    return 0;
 }
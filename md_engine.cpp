@@ -9,6 +9,7 @@ void MDEngine::knit(const std::list<Chunk> &_chunks)
         if (chunk.type == "TEXT")
         {
             // Just regular markdown
+            skip_output = false;
             for (const auto &line : chunk.lines)
             {
                 target << line << '\n';
@@ -34,6 +35,35 @@ void MDEngine::knit(const std::list<Chunk> &_chunks)
             }
             target << "```\n";
         }
+        else if (chunk.type == "BENCH")
+        {
+            // Timing table, with tab-separated cells
+            bool header = true;
+            for (const auto &line : chunk.lines)
+            {
+                target << "| ";
+                for (const auto c : line)
+                {
+                    if (c == '\t')
+                    {
+                        target << " | ";
+                    }
+                    else
+                    {
+                        target << c;
+                    }
+                }
+                target << " |\n";
+
+                if (header)
+                {
+                    target << "|---|---:|---:|---:|---:|\n";
+                    header = false;
+                }
+            }
+            target << "\n*Over " << chunk.pos_in_type
+                   << " runs after a warmup*\n";
+        }
         else
         {
             if (chunk.show_code)
@@ -47,10 +77,9 @@ void MDEngine::knit(const std::list<Chunk> &_chunks)
                 target << "```\n";
             }
 
-            if (!chunk.show_output)
-            {
-                skip_output = true;
-            }
+            // Settings chunks never have output to skip
+            skip_output =
+                !chunk.show_output && chunk.type != "SETTINGS";
         }
         target << '\n';
     }
@@ -0,0 +1,54 @@
+/*
+Replaceable global allocation functions which count every
+allocation made by JKnit.
+Jordan Dehmel
+2023 - present
+*/
+
+#include "mem_stats.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+
+static std::atomic<uint64_t> allocations = 0, bytes = 0;
+
+MemSnapshot mem_snapshot()
+{
+    MemSnapshot out;
+    struct rusage usage;
+
+    out.allocations =
+        allocations.load(std::memory_order_relaxed);
+    out.bytes = bytes.load(std::memory_order_relaxed);
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        out.peak_rss_kb = usage.ru_maxrss;
+    }
+
+    return out;
+}
+
+// The remaining (array, nothrow) forms of `new` are implemented
+// by the standard library in terms of this one
+void *operator new(std::size_t _size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(_size, std::memory_order_relaxed);
+
+    if (void *out = std::malloc(_size == 0 ? 1 : _size))
+    {
+        return out;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *_ptr) noexcept
+{
+    std::free(_ptr);
+}
+
+void operator delete(void *_ptr, std::size_t) noexcept
+{
+    std::free(_ptr);
+}
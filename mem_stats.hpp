@@ -0,0 +1,21 @@
+/*
+Process-wide memory accounting for JKnit's `-t` flag. Global
+allocations are counted through replaced `operator new`s, and
+peak RSS comes from `getrusage`.
+Jordan Dehmel
+2023 - present
+*/
+
+#pragma once
+
+#include <cstdint>
+
+struct MemSnapshot
+{
+    uint64_t allocations = 0, bytes = 0;
+    uint64_t peak_rss_kb = 0;
+};
+
+// Get the allocations and bytes allocated so far by this
+// process, along with its peak resident set size
+MemSnapshot mem_snapshot();
@@ -0,0 +1,324 @@
+/*
+Jordan Dehmel
+2023 - present
+*/
+
+#include "metrics.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <sys/file.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// A metric family, as declared in the file
+struct Family
+{
+    std::string name, type, help;
+};
+
+const static std::vector<Family> FAMILIES = {
+    {"jknit_runs_total", "counter", "Knit runs, by result"},
+    {"jknit_run_seconds", "histogram", "Wall time of each run"},
+    {"jknit_attributable_seconds_total", "counter",
+     "Wall time not spent waiting on external commands"},
+    {"jknit_phase_seconds_total", "counter",
+     "Wall time of each phase of a run"},
+    {"jknit_child_seconds", "histogram",
+     "Wall time of each external command"},
+    {"jknit_child_cpu_seconds_total", "counter",
+     "CPU time of external commands, by mode"},
+    {"jknit_jobs_total", "counter",
+     "Sessions and lone chunks run, by language"},
+    {"jknit_job_failures_total", "counter",
+     "Sessions and lone chunks which failed, by language"},
+    {"jknit_output_bytes_total", "counter",
+     "Output of sessions and lone chunks, by language"},
+    {"jknit_artifact_cache_total", "counter",
+     "Artifact cache lookups, by result"},
+    {"jknit_last_run_timestamp_seconds", "gauge",
+     "When the last run finished"},
+};
+
+const static std::vector<double> RUN_BUCKETS = {
+    0.1, 0.5, 1, 2, 5, 10, 30, 60, 300};
+const static std::vector<double> CHILD_BUCKETS = {
+    0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 30};
+
+// Every series with its value, in the order first seen. This
+// keeps histogram buckets in increasing order.
+using Series = std::vector<std::pair<std::string, double>>;
+
+static void add(Series &_into, const std::string &_series,
+                const double _value)
+{
+    for (auto &[series, value] : _into)
+    {
+        if (series == _series)
+        {
+            value += _value;
+            return;
+        }
+    }
+    _into.emplace_back(_series, _value);
+}
+
+static void set(Series &_into, const std::string &_series,
+                const double _value)
+{
+    for (auto &[series, value] : _into)
+    {
+        if (series == _series)
+        {
+            value = _value;
+            return;
+        }
+    }
+    _into.emplace_back(_series, _value);
+}
+
+// Shortest exact form, so integers print as integers
+static std::string number(const double _value)
+{
+    char buffer[64];
+    const auto result =
+        std::to_chars(buffer, buffer + sizeof(buffer), _value);
+    return std::string(buffer, result.ptr);
+}
+
+static void observe(Series &_into, const std::string &_name,
+                    const std::vector<double> &_buckets,
+                    const double _value)
+{
+    for (const auto bucket : _buckets)
+    {
+        add(_into,
+            _name + "_bucket{le=\"" + number(bucket) + "\"}",
+            _value <= bucket);
+    }
+    add(_into, _name + "_bucket{le=\"+Inf\"}", 1);
+    add(_into, _name + "_sum", _value);
+    add(_into, _name + "_count", 1);
+}
+
+// A label value, escaped
+static std::string label(const std::string &_value)
+{
+    std::string out;
+    for (const auto c : _value)
+    {
+        if (c == '\n')
+        {
+            out += "\\n";
+            continue;
+        }
+        else if (c == '\\' || c == '"')
+        {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+// The family a series belongs to, or its bare name
+static std::string family_of(const std::string &_series)
+{
+    const auto name = _series.substr(0, _series.find('{'));
+    for (const std::string suffix :
+         {"_bucket", "_sum", "_count"})
+    {
+        if (name.ends_with(suffix))
+        {
+            const auto base =
+                name.substr(0, name.size() - suffix.size());
+            for (const auto &family : FAMILIES)
+            {
+                if (family.name == base &&
+                    family.type == "histogram")
+                {
+                    return base;
+                }
+            }
+        }
+    }
+    return name;
+}
+
+// Each sample line is a series, a space and a value
+static void read(const std::string &_path, Series &_into)
+{
+    std::ifstream f(_path);
+    std::string line;
+    while (getline(f, line))
+    {
+        const auto space = line.rfind(' ');
+        if (line.empty() || line.front() == '#' ||
+            space == std::string::npos)
+        {
+            continue;
+        }
+
+        double value;
+        const auto result =
+            std::from_chars(line.data() + space + 1,
+                            line.data() + line.size(), value);
+        if (result.ec == std::errc())
+        {
+            _into.emplace_back(line.substr(0, space), value);
+        }
+    }
+}
+
+static void add_run(Series &_into, const RunStats &_stats)
+{
+    const double total_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            _stats.stop - _stats.start)
+            .count();
+
+    add(_into, "jknit_runs_total{result=\"ok\"}", 1);
+    observe(_into, "jknit_run_seconds", RUN_BUCKETS,
+            total_us / 1e6);
+
+    // Overlapping commands are counted once, so this should not
+    // be negative, but clamp anyway
+    add(_into, "jknit_attributable_seconds_total",
+        std::max(0.0, total_us - _stats.external_us) / 1e6);
+
+    for (const auto &[phase, stats] : _stats.phases)
+    {
+        add(_into,
+            "jknit_phase_seconds_total{phase=\"" +
+                label(phase) + "\"}",
+            stats.us / 1e6);
+    }
+
+    for (const auto &child : _stats.children)
+    {
+        observe(_into, "jknit_child_seconds", CHILD_BUCKETS,
+                child.us / 1e6);
+        add(_into,
+            "jknit_child_cpu_seconds_total{mode=\"user\"}",
+            child.user_us / 1e6);
+        add(_into,
+            "jknit_child_cpu_seconds_total{mode=\"system\"}",
+            child.sys_us / 1e6);
+    }
+
+    for (const auto &[name, language] : _stats.languages)
+    {
+        const auto labels = "{language=\"" + label(name) + "\"";
+        if (language.sessions != 0)
+        {
+            add(_into,
+                "jknit_jobs_total" + labels +
+                    ",kind=\"session\"}",
+                language.sessions);
+        }
+        if (language.lone != 0)
+        {
+            add(_into,
+                "jknit_jobs_total" + labels + ",kind=\"lone\"}",
+                language.lone);
+        }
+        if (language.failures != 0)
+        {
+            add(_into,
+                "jknit_job_failures_total" + labels + "}",
+                language.failures);
+        }
+        add(_into, "jknit_output_bytes_total" + labels + "}",
+            language.output_bytes);
+    }
+
+    if (_stats.cache_hits + _stats.cache_misses != 0)
+    {
+        add(_into, "jknit_artifact_cache_total{result=\"hit\"}",
+            _stats.cache_hits);
+        add(_into,
+            "jknit_artifact_cache_total{result=\"miss\"}",
+            _stats.cache_misses);
+    }
+}
+
+void write_metrics(const std::string &_path,
+                   const RunStats *_stats)
+{
+    // Concurrent runs take turns, so neither's counts are lost
+    const int lock = open((_path + ".lock").c_str(),
+                          O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX) != 0)
+    {
+        if (lock >= 0)
+        {
+            close(lock);
+        }
+        throw std::runtime_error(
+            "Failed to lock metrics file '" + _path + "'");
+    }
+
+    Series series;
+    read(_path, series);
+    if (_stats != nullptr)
+    {
+        add_run(series, *_stats);
+    }
+    else
+    {
+        add(series, "jknit_runs_total{result=\"error\"}", 1);
+    }
+    set(series, "jknit_last_run_timestamp_seconds",
+        std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count());
+
+    // The collector must never see a partly written file
+    const auto temp =
+        _path + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream f(temp);
+    for (const auto &family : FAMILIES)
+    {
+        bool declared = false;
+        for (const auto &[name, value] : series)
+        {
+            if (family_of(name) != family.name)
+            {
+                continue;
+            }
+            else if (!declared)
+            {
+                f << "# HELP " << family.name << ' '
+                  << family.help << '\n'
+                  << "# TYPE " << family.name << ' '
+                  << family.type << '\n';
+                declared = true;
+            }
+            f << name << ' ' << number(value) << '\n';
+        }
+    }
+    f.close();
+
+    std::error_code ec;
+    if (f.fail())
+    {
+        std::filesystem::remove(temp, ec);
+    }
+    else
+    {
+        std::filesystem::rename(temp, _path, ec);
+    }
+    close(lock);
+
+    if (f.fail() || ec)
+    {
+        throw std::runtime_error(
+            "Failed to write metrics file '" + _path + "'");
+    }
+}
@@ -0,0 +1,18 @@
+/*
+Prometheus textfile output, as scraped by node_exporter's
+textfile collector. Each run adds its own counts to those
+already in the file, so every series is a counter (or histogram)
+over all runs, and no run is lost between scrapes.
+Jordan Dehmel
+2023 - present
+*/
+
+#pragma once
+
+#include "engine.hpp"
+#include <string>
+
+// Add a run's stats to the metrics in the given file. Without
+// stats, the run is counted as failed.
+void write_metrics(const std::string &_path,
+                   const RunStats *_stats);
@@ -0,0 +1,118 @@
+/*
+Jordan Dehmel
+2023 - present
+*/
+
+#include "scan.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JKNIT_X86
+#endif
+
+// Returns the index of the first character in (or, if `Negate`,
+// not in) the set `Cs`
+template <bool Negate, char... Cs>
+static uint64_t find_scalar(const char *_data, uint64_t _size)
+{
+    for (uint64_t i = 0; i < _size; ++i)
+    {
+        if (((_data[i] == Cs) || ...) != Negate)
+        {
+            return i;
+        }
+    }
+    return _size;
+}
+
+#ifdef JKNIT_X86
+
+template <bool Negate, char... Cs>
+static uint64_t find_sse2(const char *_data, uint64_t _size)
+{
+    uint64_t i = 0;
+    for (; i + 16 <= _size; i += 16)
+    {
+        const __m128i block =
+            _mm_loadu_si128((const __m128i *)(_data + i));
+        __m128i hits = _mm_setzero_si128();
+        ((hits = _mm_or_si128(
+              hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(Cs)))),
+         ...);
+
+        uint32_t mask = _mm_movemask_epi8(hits);
+        if (Negate)
+        {
+            mask ^= 0xFFFF;
+        }
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + find_scalar<Negate, Cs...>(_data + i, _size - i);
+}
+
+template <bool Negate, char... Cs>
+__attribute__((target("avx2"))) static uint64_t find_avx2(
+    const char *_data, uint64_t _size)
+{
+    uint64_t i = 0;
+    for (; i + 32 <= _size; i += 32)
+    {
+        const __m256i block =
+            _mm256_loadu_si256((const __m256i *)(_data + i));
+        __m256i hits = _mm256_setzero_si256();
+        ((hits = _mm256_or_si256(
+              hits,
+              _mm256_cmpeq_epi8(block, _mm256_set1_epi8(Cs)))),
+         ...);
+
+        uint32_t mask = _mm256_movemask_epi8(hits);
+        if (Negate)
+        {
+            mask = ~mask;
+        }
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + find_sse2<Negate, Cs...>(_data + i, _size - i);
+}
+
+#endif
+
+using Finder = uint64_t (*)(const char *, uint64_t);
+
+// Pick the widest implementation this CPU supports
+template <bool Negate, char... Cs> static Finder select_finder()
+{
+#ifdef JKNIT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return find_avx2<Negate, Cs...>;
+    }
+    return find_sse2<Negate, Cs...>;
+#else
+    return find_scalar<Negate, Cs...>;
+#endif
+}
+
+uint64_t find_tex_special(const char *_data, uint64_t _size)
+{
+    // Must match the cases of `TEXEngine::write_text`
+    const static Finder finder =
+        select_finder<false, '\\', '*', '_', '$', '`', '%', '~',
+                      '#', '^'>();
+    return finder(_data, _size);
+}
+
+uint64_t find_fence_byte(const char *_data, uint64_t _size)
+{
+    const static Finder finder = select_finder<false, '`'>();
+    return finder(_data, _size);
+}
@@ -0,0 +1,20 @@
+/*
+Vectorized scanners for JKnit's own hot loops: Finding fences
+while parsing, and finding characters which need escaping while
+writing TeX. The widest instruction set the CPU supports is
+picked at runtime, with a scalar fallback.
+Jordan Dehmel
+2023 - present
+*/
+
+#pragma once
+
+#include <cstdint>
+
+// Index of the first character of the given range which needs
+// special handling in TeX text, or `_size` if there is none
+uint64_t find_tex_special(const char *_data, uint64_t _size);
+
+// Index of the first backtick in the given range, or `_size` if
+// there is none. Only lines holding one can be fences.
+uint64_t find_fence_byte(const char *_data, uint64_t _size);
@@ -4,18 +4,147 @@ Jordan Dehmel
 */
 
 #include "tex_engine.hpp"
+#include "scan.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cwctype>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
 #include <stack>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// did NOT have fun typing these
+constexpr std::string_view lstSupportedLangs[] = {
+    "ABAP",        "ACM",       "ACSL",        "ALGOL",
+    "ASSEMBLER",   "BASH",      "C",           "C++",
+    "CIL",         "COBOL",     "COMMAND.COM", "CSH",
+    "EIFFEL",      "ELISP",     "EUPHORIA",    "GAP",
+    "GNUPLOT",     "HANSL",     "HTML",        "INFORM",
+    "JVMIS",       "LINGO",     "LLVM",        "LUA",
+    "MATHEMATICA", "MERCURY",   "MIRANDA",     "ML",
+    "MUPAD",       "OBERON-2",  "OCTAVE",      "OZ",
+    "PERL",        "PL/I",      "POSTSCRIPT",  "PROLOG",
+    "PSTRICKS",    "R",         "REXX",        "RUBY",
+    "SAS",         "SCILAB",    "SHELXL",      "SPARQL",
+    "SWIFT",       "TEX",       "VBSCRIPT",    "VHDL",
+    "XML",         "ACMSCRIPT", "ADA",         "ANT",
+    "AWK",         "BASIC",     "CAML",        "CLEAN",
+    "COMSOL",      "DELPHI",    "ELAN",        "ERLANG",
+    "FORTRAN",     "GCL",       "GO",          "HASKELL",
+    "IDL",         "JAVA",      "KSH",         "LISP",
+    "LOGO",        "MAKE",      "MATLAB",      "METAPOST",
+    "MIZAR",       "MODULA-2",  "NASTRAN",     "OCL",
+    "OOREXX",      "PASCAL",    "PHP",         "PLASM",
+    "POV",         "PROMELA",   "PYTHON",      "REDUCE",
+    "RSL",         "S",         "SCALA",       "SH",
+    "SIMULA",      "SQL",       "TCL",         "VERILOG",
+    "VRML",        "XSLT"};
+
+// Seeded FNV-1a
+constexpr uint32_t lang_hash(std::string_view _s,
+                             uint32_t _seed)
+{
+    uint32_t out = 2166136261u ^ _seed;
+    for (const char c : _s)
+    {
+        out = (out ^ (uint8_t)c) * 16777619u;
+    }
+    return out;
+}
+
+// Each slot holds 1 + the index of the language hashing to it,
+// or 0 if none does
+constexpr uint64_t LANG_SLOTS = 1024;
+static_assert(std::size(lstSupportedLangs) < 256);
+
+// The first seed which gives every language its own slot
+consteval uint32_t find_lang_seed()
+{
+    for (uint32_t seed = 0;; ++seed)
+    {
+        bool used[LANG_SLOTS] = {}, perfect = true;
+        for (const auto &lang : lstSupportedLangs)
+        {
+            const auto slot =
+                lang_hash(lang, seed) % LANG_SLOTS;
+            perfect = perfect && !used[slot];
+            used[slot] = true;
+        }
 
-void handle_md(const std::list<std::string> &, std::ostream &);
+        if (perfect)
+        {
+            return seed;
+        }
+    }
+}
+
+constexpr uint32_t LANG_SEED = find_lang_seed();
+
+constexpr auto LANG_TABLE = []()
+{
+    std::array<uint8_t, LANG_SLOTS> out = {};
+    for (uint64_t i = 0; i < std::size(lstSupportedLangs); ++i)
+    {
+        out[lang_hash(lstSupportedLangs[i], LANG_SEED) %
+            LANG_SLOTS] = i + 1;
+    }
+    return out;
+}();
+
+bool TEXEngine::lst_supports(std::string_view _lang)
+{
+    const auto entry =
+        LANG_TABLE[lang_hash(_lang, LANG_SEED) % LANG_SLOTS];
+    return entry != 0 && lstSupportedLangs[entry - 1] == _lang;
+}
+
+// Character classes used while rendering markdown
+constexpr uint8_t TEX_SPECIAL = 1, // Wrapped in \texttt
+    LIST_CHAR = 2;                  // Marks an unnumbered item
+
+constexpr auto CHAR_CLASSES = []()
+{
+    std::array<uint8_t, 256> out = {};
+    for (const char c : TEXEngine::specialCharacters)
+    {
+        out[(uint8_t)c] |= TEX_SPECIAL;
+    }
+    for (const char c : std::string_view("-:;.,)]"))
+    {
+        out[(uint8_t)c] |= LIST_CHAR;
+    }
+    return out;
+}();
+
+constexpr bool is_class(const char _c, const uint8_t _class)
+{
+    return (CHAR_CLASSES[(uint8_t)_c] & _class) != 0;
+}
 
 // Translate into latex
 void TEXEngine::knit(const std::list<Chunk> &_chunks)
 {
+    blocks.clear();
+
     // Header
     for (const auto &l : latexHeader)
     {
+        if (l == "\\begin{document}" &&
+            settings.externalize_lines != 0)
+        {
+            for (const auto &e : externalHeader)
+            {
+                target << e << '\n';
+            }
+        }
         target << l << '\n';
     }
 
@@ -25,7 +154,52 @@ void TEXEngine::knit(const std::list<Chunk> &_chunks)
                << "\\sffamily\n";
     }
 
+    // Markdown text is the hard part, but TEXT chunks do not
+    // depend on one another: Render them on every core in
+    // document order, and splice each one in once it is done.
+    std::vector<const Chunk *> text_chunks;
+    for (const auto &chunk : _chunks)
+    {
+        if (chunk.type == "TEXT" && !chunk.lines.empty())
+        {
+            text_chunks.push_back(&chunk);
+        }
+    }
+
+    std::vector<std::promise<std::string>> rendered(
+        text_chunks.size());
+    std::atomic<uint64_t> next_text = 0;
+    const auto render_text = [&]()
+    {
+        uint64_t i;
+        while ((i = next_text++) < text_chunks.size())
+        {
+            try
+            {
+                std::ostringstream out;
+                handle_md(text_chunks[i]->lines, out);
+                rendered[i].set_value(out.str());
+            }
+            catch (...)
+            {
+                rendered[i].set_exception(
+                    std::current_exception());
+            }
+        }
+    };
+
+    // Declared after `rendered` so these are joined first
+    std::vector<std::jthread> workers;
+    const uint64_t num_workers = std::min<uint64_t>(
+        std::max(1u, std::thread::hardware_concurrency()),
+        text_chunks.size());
+    for (uint64_t i = 0; i < num_workers; ++i)
+    {
+        workers.emplace_back(render_text);
+    }
+
     // Body
+    uint64_t text_index = 0;
     for (const auto &chunk : _chunks)
     {
         if (chunk.lines.empty())
@@ -35,8 +209,7 @@ void TEXEngine::knit(const std::list<Chunk> &_chunks)
         }
         else if (chunk.type == "TEXT")
         {
-            // Markdown text: This is the hard part.
-            handle_md(chunk.lines, target);
+            target << rendered[text_index++].get_future().get();
         }
         else if (chunk.type == "OUTPUT")
         {
@@ -46,6 +219,13 @@ void TEXEngine::knit(const std::list<Chunk> &_chunks)
             }
 
             // Code output
+            const auto file = externalize(chunk.lines);
+            if (!file.empty())
+            {
+                target << "\\outputfile{" << file << "}\n\n";
+                continue;
+            }
+
             for (const auto &l : startOutput)
             {
                 target << l << '\n';
@@ -61,6 +241,38 @@ void TEXEngine::knit(const std::list<Chunk> &_chunks)
                 target << l << '\n';
             }
         }
+        else if (chunk.type == "BENCH")
+        {
+            // Timing table, with tab-separated cells
+            target << "\\begin{center}\n"
+                   << "\\begin{tabular}{l r r r r}\n";
+            bool header = true;
+            for (const auto &line : chunk.lines)
+            {
+                for (const auto c : line)
+                {
+                    if (c == '\t')
+                    {
+                        target << " & ";
+                    }
+                    else
+                    {
+                        target << c;
+                    }
+                }
+                target << " \\\\\n";
+
+                if (header)
+                {
+                    target << "\\hline\n";
+                    header = false;
+                }
+            }
+            target << "\\end{tabular}\n\n"
+                   << "Over " << chunk.pos_in_type
+                   << " runs after a warmup\n"
+                   << "\\end{center}\n";
+        }
         else
         {
             // Code input
@@ -69,7 +281,7 @@ void TEXEngine::knit(const std::list<Chunk> &_chunks)
                 continue;
             }
 
-            if (lstSupportedLangs.count(chunk.type) != 0)
+            if (lst_supports(chunk.type))
             {
                 target << "\\lstset{language=" << chunk.type
                        << "}\n";
@@ -79,6 +291,13 @@ void TEXEngine::knit(const std::list<Chunk> &_chunks)
                 target << "\\lstset{language=C++}\n";
             }
 
+            const auto file = externalize(chunk.lines);
+            if (!file.empty())
+            {
+                target << "\\codefile{" << file << "}\n\n";
+                continue;
+            }
+
             for (const auto &l : startCode)
             {
                 target << l << '\n';
@@ -103,418 +322,558 @@ void TEXEngine::knit(const std::list<Chunk> &_chunks)
     }
 }
 
-////////////////////////////////////////////////////////////////
-
-void TEXEngine::handle_md(const std::list<std::string> &_lines,
-                          std::ostream &_target)
+std::string
+TEXEngine::externalize(const std::list<std::string> &_lines)
 {
-    const static std::string specialCharacters = "%$~#&^";
-    const static std::string listChars = "-:;.,)]";
+    if (settings.externalize_lines == 0 ||
+        _lines.size() <= settings.externalize_lines)
+    {
+        return "";
+    }
 
-    std::string line;
-    bool in_blockquote = false;
-    int64_t ws_offset = -1, prev_ws_offset;
-    std::stack<std::pair<int, std::string>> list_closure_stack;
+    const std::filesystem::path target_path(settings.target);
+    std::stringstream name;
+    name << target_path.stem().string() << "-blocks/"
+         << std::hex << std::setw(16) << std::setfill('0')
+         << hash_lines(_lines) << ".txt";
+    const auto path = target_path.parent_path() / name.str();
+
+    // Files are named for their contents, so an existing one is
+    // left alone (along with its mtime)
+    std::error_code ec;
+    if (std::filesystem::exists(path, ec))
+    {
+        blocks.insert(name.str());
+        return name.str();
+    }
 
-    for (auto it = _lines.begin(); it != _lines.end(); ++it)
+    std::filesystem::create_directories(path.parent_path(), ec);
+    const auto temp =
+        path.string() + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream f(temp);
+    for (const auto &l : _lines)
     {
-        line = *it;
-        if (line.empty())
+        f << l << '\n';
+    }
+    f.close();
+
+    if (!f.fail())
+    {
+        std::filesystem::rename(temp, path, ec);
+    }
+    if (f.fail() || ec)
+    {
+        std::filesystem::remove(temp, ec);
+        if (settings.all_errors)
         {
-            if (in_blockquote)
-            {
-                _target << "\\end{displayquote}\n";
-                in_blockquote = false;
-            }
+            throw std::runtime_error("Failed to write block '" +
+                                     path.string() + "'");
         }
 
-        prev_ws_offset = ws_offset;
-        ws_offset = 0;
+        // Written inline instead
+        std::cerr << "WARNING: " << "Failed to write block '"
+                  << path.string() << "'\n";
+        return "";
+    }
+    blocks.insert(name.str());
+    return name.str();
+}
 
-        // Get new whitespace offset
-        while (ws_offset < (int64_t)line.size() &&
-               iswspace(line[ws_offset]))
+void TEXEngine::save_target()
+{
+    Engine::save_target();
+
+    // Side files are only ever named for a 16-digit hash, so
+    // nothing else in the directory is touched
+    const std::filesystem::path target_path(settings.target);
+    const auto directory =
+        target_path.stem().string() + "-blocks";
+    std::error_code ec;
+    for (const auto &entry :
+         std::filesystem::directory_iterator(
+             target_path.parent_path() / directory, ec))
+    {
+        const auto name = entry.path().filename().string();
+        if (name.size() == 20 && name.ends_with(".txt") &&
+            name.find_first_not_of("0123456789abcdef") == 16 &&
+            !blocks.contains(directory + "/" + name))
         {
-            ++ws_offset;
+            std::filesystem::remove(entry.path(), ec);
         }
+    }
+}
 
-        // Trim off whitespace for further processing
-        line = line.substr(ws_offset);
+////////////////////////////////////////////////////////////////
 
-        // Deal with de-indentation within lists
-        while (!list_closure_stack.empty() &&
-               ws_offset < list_closure_stack.top().first)
-        {
-            _target << list_closure_stack.top().second;
-            list_closure_stack.pop();
-        }
+// The state of one level of markdown. Line-level constructs
+// (quotes, headers, list items, links and captions) contain
+// more markdown: Rather than recursing, their remainder is
+// rendered in a new single-line frame, and `suffix` is written
+// once that frame is done.
+struct MDFrame
+{
+    bool in_blockquote = false;
+    int64_t ws_offset = -1;
+    std::stack<std::pair<int64_t, std::string>>
+        list_closure_stack;
+    std::string text, suffix;
+};
+
+// Close everything still open in the given frame
+static void close_frame(MDFrame &_frame, std::ostream &_target)
+{
+    while (!_frame.list_closure_stack.empty())
+    {
+        _target << _frame.list_closure_stack.top().second;
+        _frame.list_closure_stack.pop();
+    }
 
-        if (line[0] == '%')
-        {
-            // Ignore comment lines
-            continue;
-        }
+    if (_frame.in_blockquote)
+    {
+        _target << "\\end{displayquote}\n";
+        _frame.in_blockquote = false;
+    }
+
+    _target << _frame.suffix;
+}
+
+void TEXEngine::handle_md(const std::list<std::string> &_lines,
+                          std::ostream &_target)
+{
+    std::string_view line;
+    int64_t prev_ws_offset;
+
+    // frames.front() lasts for all lines; The rest are nested
+    // single-line frames. A deque keeps `text` from moving.
+    std::deque<MDFrame> frames(1);
 
-        if (line[0] == '>')
+    for (auto it = _lines.begin(); it != _lines.end(); ++it)
+    {
+        line = *it;
+
+        // Each iteration renders `line` in frames.back(). A
+        // nested construct pushes a frame and continues;
+        // Anything else breaks.
+        while (true)
         {
-            // Block quote
-            if (!in_blockquote)
+            MDFrame &frame = frames.back();
+
+            if (line.empty() && frame.in_blockquote)
             {
-                _target << "\\begin{displayquote}\n";
-                in_blockquote = true;
+                _target << "\\end{displayquote}\n";
+                frame.in_blockquote = false;
             }
 
-            handle_md({line.substr(1)}, _target);
-            continue;
-        }
-        else if (in_blockquote)
-        {
-            _target << "\\end{displayquote}\n";
-            in_blockquote = false;
-        }
-
-        if (line[0] == '#')
-        {
-            // Header
+            prev_ws_offset = frame.ws_offset;
+            frame.ws_offset = 0;
 
-            // # => \section{}
-            // ## => \subsection{}
-            // ### => \subsubsection{}
-            // #### => \paragraph{}
-            // #####+ => \subparagraph{}
+            // Get new whitespace offset
+            while (frame.ws_offset < (int64_t)line.size() &&
+                   iswspace(line[frame.ws_offset]))
+            {
+                ++frame.ws_offset;
+            }
 
-            _target << "\\bigskip{}\n";
+            // Trim off whitespace for further processing
+            line.remove_prefix(frame.ws_offset);
+            const char first = line.empty() ? '\0' : line[0];
 
-            int num_pounds = 0;
-            while (line[num_pounds] == '#')
+            // Deal with de-indentation within lists
+            while (!frame.list_closure_stack.empty() &&
+                   frame.ws_offset <
+                       frame.list_closure_stack.top().first)
             {
-                num_pounds++;
+                _target
+                    << frame.list_closure_stack.top().second;
+                frame.list_closure_stack.pop();
             }
 
-            switch (num_pounds)
+            if (first == '%')
             {
-            case 1:
-                _target << "\\section*{";
-                break;
-            case 2:
-                _target << "\\subsection*{";
-                break;
-            case 3:
-                _target << "\\subsubsection*{";
-                break;
-            case 4:
-                _target << "\\paragraph*{";
+                // Ignore comment lines
                 break;
-            default:
-                _target << "\\subparagraph*{";
-                break;
-            };
-
-            handle_md({line.substr(num_pounds)}, _target);
-            _target << "}~\n";
+            }
 
-            _target << "\\bigskip{}\n";
-            continue;
-        }
+            if (first == '>')
+            {
+                // Block quote
+                if (!frame.in_blockquote)
+                {
+                    _target << "\\begin{displayquote}\n";
+                    frame.in_blockquote = true;
+                }
 
-        if (line[0] == '[')
-        {
-            // Link
-            std::string title, link;
+                frames.emplace_back();
+                line.remove_prefix(1);
+                continue;
+            }
+            else if (frame.in_blockquote)
+            {
+                _target << "\\end{displayquote}\n";
+                frame.in_blockquote = false;
+            }
 
-            // Scan until end of title
-            unsigned int i = 1;
-            while (i < line.size() && line[i] != ']')
+            if (first == '#')
             {
-                if (specialCharacters.find(line[i]) !=
-                    std::string::npos)
+                // Header
+
+                // # => \section{}
+                // ## => \subsection{}
+                // ### => \subsubsection{}
+                // #### => \paragraph{}
+                // #####+ => \subparagraph{}
+
+                _target << "\\bigskip{}\n";
+
+                uint64_t num_pounds = 0;
+                while (num_pounds < line.size() &&
+                       line[num_pounds] == '#')
                 {
-                    title += std::string("\\texttt{") +
-                             line[i] + "}";
+                    num_pounds++;
                 }
-                else
+
+                switch (num_pounds)
                 {
-                    title += line[i];
-                }
-                i++;
+                case 1:
+                    _target << "\\section*{";
+                    break;
+                case 2:
+                    _target << "\\subsection*{";
+                    break;
+                case 3:
+                    _target << "\\subsubsection*{";
+                    break;
+                case 4:
+                    _target << "\\paragraph*{";
+                    break;
+                default:
+                    _target << "\\subparagraph*{";
+                    break;
+                };
+
+                frames.emplace_back();
+                frames.back().suffix = "}~\n\\bigskip{}\n";
+                line.remove_prefix(num_pounds);
+                continue;
             }
 
-            if (line[i + 1] != '(')
+            if (first == '[')
             {
-                for (auto c : line)
+                // Link
+                std::string title, link;
+
+                // Scan until end of title
+                uint64_t i = 1;
+                while (i < line.size() && line[i] != ']')
                 {
-                    if (specialCharacters.find(c) !=
-                        std::string::npos)
+                    if (is_class(line[i], TEX_SPECIAL))
                     {
-                        _target << "\\texttt{" << c << "}";
+                        title += std::string("\\texttt{") +
+                                 line[i] + "}";
                     }
                     else
                     {
-                        _target << c;
+                        title += line[i];
                     }
+                    i++;
                 }
-                _target << '\n';
-                continue;
-            }
 
-            // Scan until end of link
-            i += 2;
-            while (i < line.size() && line[i] != ')')
-            {
-                if (specialCharacters.find(line[i]) !=
-                    std::string::npos)
+                if (i + 1 >= line.size() || line[i + 1] != '(')
                 {
-                    line += std::string("\\texttt{") + line[i] +
-                            "}";
+                    for (auto c : line)
+                    {
+                        if (is_class(c, TEX_SPECIAL))
+                        {
+                            _target << "\\texttt{" << c << "}";
+                        }
+                        else
+                        {
+                            _target << c;
+                        }
+                    }
+                    _target << '\n';
+                    break;
                 }
-                else
+
+                // Scan until end of link
+                i += 2;
+                while (i < line.size() && line[i] != ')')
                 {
+                    if (line[i] == '%' || line[i] == '#')
+                    {
+                        link += '\\';
+                    }
                     link += line[i];
+                    i++;
                 }
-                i++;
-            }
-
-            // Write latex
-            _target << "\\href{" << link << "}{";
 
-            // Catch any internal markdown syntax
-            handle_md({title}, _target);
-
-            _target << "}\n";
-
-            continue;
-        }
+                // Write latex
+                _target << "\\href{" << link << "}{";
 
-        if (line[0] == '!')
-        {
-            // Image
-            std::string alt, path, options;
-
-            // Parse caption, path and options
-            unsigned int i = 2;
-            while (i < line.size() && line[i] != ']')
-            {
-                if (specialCharacters.find(line[i]) !=
-                    std::string::npos)
-                {
-                    alt += std::string("\\texttt{") + line[i] +
-                           "}";
-                }
-                else
-                {
-                    alt += line[i];
-                }
-                i++;
+                // Catch any internal markdown syntax
+                frames.emplace_back();
+                frames.back().text = std::move(title);
+                frames.back().suffix = "}\n";
+                line = frames.back().text;
+                continue;
             }
-            i += 2;
-            while (i < line.size() && line[i] != ')')
+
+            if (first == '!')
             {
-                if (specialCharacters.find(line[i]) !=
-                    std::string::npos)
+                // Image
+                std::string alt, path, options;
+
+                // Parse caption, path and options
+                uint64_t i = 2;
+                while (i < line.size() && line[i] != ']')
                 {
-                    path += std::string("\\texttt{") + line[i] +
-                            "}";
+                    if (is_class(line[i], TEX_SPECIAL))
+                    {
+                        alt += std::string("\\texttt{") +
+                               line[i] + "}";
+                    }
+                    else
+                    {
+                        alt += line[i];
+                    }
+                    i++;
                 }
-                else
+                i += 2;
+                while (i < line.size() && line[i] != ')')
                 {
-                    path += line[i];
+                    if (is_class(line[i], TEX_SPECIAL))
+                    {
+                        path += std::string("\\texttt{") +
+                                line[i] + "}";
+                    }
+                    else
+                    {
+                        path += line[i];
+                    }
+                    i++;
                 }
-                i++;
-            }
-            i += 2;
-            while (i < line.size() && line[i] != '}')
-            {
-                // Percentage parsing
-                if (line[i] >= '0' && line[i] <= '9')
+                i += 2;
+                while (i < line.size() && line[i] != '}')
                 {
-                    std::string num = "00";
-                    while (i < line.size() && line[i] >= '0' &&
-                           line[i] <= '9')
+                    // Percentage parsing
+                    if (line[i] >= '0' && line[i] <= '9')
                     {
-                        num += line[i];
-                        i++;
+                        std::string num = "00";
+                        while (i < line.size() &&
+                               line[i] >= '0' && line[i] <= '9')
+                        {
+                            num += line[i];
+                            i++;
+                        }
+
+                        if (i < line.size() && line[i] == '%')
+                        {
+                            num =
+                                num.substr(0, num.size() - 2) +
+                                "." +
+                                num.substr(num.size() - 2);
+                            options += num + "\\textwidth ";
+                            i++;
+                        }
+                        else
+                        {
+                            options += num;
+                        }
                     }
 
-                    if (i < line.size() && line[i] == '%')
+                    // Avoid issues with commenting
+                    if (i < line.size() && line[i] != '%' &&
+                        line[i] != '}')
                     {
-                        num = num.substr(0, num.size() - 2) +
-                              "." + num.substr(num.size() - 2);
-                        options += num + "\\textwidth ";
-                        i++;
-                    }
-                    else
-                    {
-                        options += num;
+                        options += line[i];
                     }
+                    i++;
                 }
 
-                // Avoid issues with commenting
-                if (i < line.size() && line[i] != '%' &&
-                    line[i] != '}')
+                if (options == "")
                 {
-                    options += line[i];
+                    options = "width=0.5\\textwidth";
                 }
-                i++;
-            }
 
-            if (options == "")
-            {
-                options = "width=0.5\\textwidth";
-            }
+                // Convert to latex
+                _target << "\\begin{figure}[h]\n"
+                        << "\\centering\n"
+                        << "\\includegraphics[" << options
+                        << "]{" << path << "}\n";
 
-            // Convert to latex
-            _target << "\\begin{figure}[h]\n"
-                    << "\\centering\n"
-                    << "\\includegraphics[" << options << "]{"
-                    << path << "}\n";
+                if (alt.empty())
+                {
+                    _target << "\\end {figure}\n";
+                    break;
+                }
 
-            if (!alt.empty())
-            {
                 _target << "\\caption {";
-                handle_md({alt}, _target);
-                _target << "}\n";
+                frames.emplace_back();
+                frames.back().text = std::move(alt);
+                frames.back().suffix = "}\n\\end {figure}\n";
+                line = frames.back().text;
+                continue;
             }
 
-            _target << "\\end {figure}\n";
+            if (line.starts_with("--") ||
+                line.starts_with("~~") ||
+                line.starts_with("___") ||
+                line.starts_with("=="))
+            {
+                // Horizontal rule
+                _target << "\\hrule{}\n";
+                break;
+            }
 
-            continue;
-        }
+            if (is_class(first, LIST_CHAR))
+            {
+                // Unnumbered list
+                if (frame.list_closure_stack.empty() ||
+                    frame.ws_offset > prev_ws_offset)
+                {
+                    // New sublist
+                    _target << "\\begin{itemize}\n";
+                    frame.list_closure_stack.push(
+                        {frame.ws_offset, "\\end{itemize}\n"});
+                }
+                _target << "\\item ";
 
-        if (line.starts_with("--") || line.starts_with("~~") ||
-            line.starts_with("___") || line.starts_with("=="))
-        {
-            // Horizontal rule
-            _target << "\\hrule{}\n";
-            continue;
-        }
+                // Write the rest of this line
+                frames.emplace_back();
+                line.remove_prefix(
+                    std::min<uint64_t>(2, line.size()));
+                continue;
+            }
 
-        if (listChars.find(line[0]) != std::string::npos)
-        {
-            // Unnumbered list
-            if (list_closure_stack.empty() ||
-                ws_offset > prev_ws_offset)
+            if (line.size() > 1 && isalnum(first) &&
+                is_class(line[1], LIST_CHAR))
             {
-                // New sublist
-                _target << "\\begin{itemize}\n";
-                list_closure_stack.push(
-                    {ws_offset, "\\end{itemize}\n"});
+                // Numbered list
+                if (frame.list_closure_stack.empty() ||
+                    frame.ws_offset > prev_ws_offset)
+                {
+                    // New sublist
+                    _target << "\\begin{enumerate}\n";
+                    frame.list_closure_stack.push(
+                        {frame.ws_offset,
+                         "\\end{enumerate}\n"});
+                }
+                _target << "\\item ";
+
+                // Write the rest of this line
+                frames.emplace_back();
+                line.remove_prefix(2);
+                continue;
             }
-            _target << "\\item ";
 
-            // Write the rest of this line
-            handle_md({line.substr(2)}, _target);
-            continue;
+            // Normal text line
+            write_text(line, _target);
+            _target << '\n';
+            break;
         }
 
-        if (line.size() > 1 && isalnum(line[0]) &&
-            listChars.find(line[1]) != std::string::npos)
+        // Finish any nested frames
+        while (frames.size() > 1)
         {
-            // Numbered list
-            if (list_closure_stack.empty() ||
-                ws_offset > prev_ws_offset)
-            {
-                // New sublist
-                _target << "\\begin{enumerate}\n";
-                list_closure_stack.push(
-                    {ws_offset, "\\end{enumerate}\n"});
-            }
-            _target << "\\item ";
-
-            // Write the rest of this line
-            handle_md({line.substr(2)}, _target);
-            continue;
+            close_frame(frames.back(), _target);
+            frames.pop_back();
         }
+    }
 
-        // Normal text line
-        for (uint64_t i = 0; i < line.size(); ++i)
+    close_frame(frames.front(), _target);
+}
+
+// Write a single line of inline markdown
+void TEXEngine::write_text(std::string_view _line,
+                           std::ostream &_target)
+{
+    uint64_t end;
+    for (uint64_t i = 0; i < _line.size(); ++i)
+    {
+        // Copy any run of ordinary characters in bulk
+        end = find_tex_special(_line.data() + i,
+                               _line.size() - i);
+        _target.write(_line.data() + i, end);
+        i += end;
+        if (i == _line.size())
         {
-            const char c = line[i];
+            break;
+        }
+
+        const char c = _line[i];
 
-            switch (c)
+        switch (c)
+        {
+        case '\\':
+            if (i + 1 < _line.size() &&
+                (_line[i + 1] == '_' || _line[i + 1] == '*'))
             {
-            case '\\':
-                if (i + 1 < line.size() &&
-                    (line[i + 1] == '_' || line[i + 1] == '*'))
-                {
-                    _target << line[i + 1];
-                    ++i;
-                }
-                else
-                {
-                    _target << c;
-                }
-                break;
-            case '*':
-            case '_':
+                _target << _line[i + 1];
                 ++i;
-                if (line[i] == c)
-                {
-                    // Boldface
-                    _target << "\\textbf{";
-                    for (++i;
-                         i + 1 < line.size() &&
-                         !(line[i] == c && line[i + 1] == c);
-                         ++i)
-                    {
-                        _target << line[i];
-                    }
-                    ++i;
-                    _target << '}';
-                }
-                else
-                {
-                    // Italics
-                    _target << "\\textit{";
-                    for (; i + 1 < line.size() && line[i] != c;
-                         ++i)
-                    {
-                        _target << line[i];
-                    }
-                    _target << '}';
-                }
-
-                break;
-
-            case '$':
+            }
+            else
+            {
                 _target << c;
-                for (++i; line[i] != c; ++i)
+            }
+            break;
+        case '*':
+        case '_':
+            ++i;
+            if (i < _line.size() && _line[i] == c)
+            {
+                // Boldface
+                _target << "\\textbf{";
+                for (++i; i + 1 < _line.size() &&
+                          !(_line[i] == c && _line[i + 1] == c);
+                     ++i)
                 {
-                    _target << line[i];
+                    _target << _line[i];
                 }
-                _target << c;
-                break;
-
-            case '`':
-                _target << "\\texttt{";
-                for (++i; line[i] != c; ++i)
+                ++i;
+                _target << '}';
+            }
+            else
+            {
+                // Italics
+                _target << "\\textit{";
+                for (; i + 1 < _line.size() && _line[i] != c;
+                     ++i)
                 {
-                    _target << line[i];
+                    _target << _line[i];
                 }
                 _target << '}';
-                break;
+            }
 
-            // Otherwise uncovered TeX-illegal characters
-            case '%':
-            case '~':
-            case '#':
-            case '^':
-                _target << '\\' << c;
-                break;
+            break;
 
-            // Base case
-            default:
-                _target << c;
+        case '$':
+        case '`':
+            end = _line.find(c, i + 1);
+            if (end == std::string_view::npos)
+            {
+                // Unterminated: Just a character
+                _target << (c == '$' ? "\\$" : "`");
                 break;
             }
-        }
-        _target << '\n';
 
-        continue;
-    }
-
-    while (!list_closure_stack.empty())
-    {
-        _target << list_closure_stack.top().second;
-        list_closure_stack.pop();
+            _target << (c == '$' ? "$" : "\\texttt{")
+                    << _line.substr(i + 1, end - i - 1)
+                    << (c == '$' ? '$' : '}');
+            i = end;
+            break;
+
+        // Otherwise uncovered TeX-illegal characters
+        case '%':
+        case '~':
+        case '#':
+        case '^':
+            _target << '\\' << c;
+            break;
+
+        // Base case
+        default:
+            _target << c;
+            break;
+        }
     }
 }
@@ -8,7 +8,9 @@ github.com/jorbDehmel
 #pragma once
 
 #include "engine.hpp"
+#include <array>
 #include <set>
+#include <string_view>
 static_assert(__cplusplus >= 2020'00UL);
 
 class TEXEngine : public Engine
@@ -19,101 +21,144 @@ class TEXEngine : public Engine
     {
     }
 
-    const std::string specialCharacters = "%$~#&^";
+    constexpr static std::string_view specialCharacters =
+        "%$~#&^";
 
     // If true, uses the default LaTeX font. If false, uses the
     // (IMO more visually appealling) sf font.
     bool forceFormalFont = false;
 
-    const std::vector<std::string>
-        latexHeader =
-            {"\\documentclass[10pt]{article}",
-             "\\usepackage[margin=1in]{geometry}",
-             "\\usepackage{background}",
-             "\\usepackage{csquotes}",
-             "\\usepackage{graphicx}",
-             "\\usepackage{hyperref}",
-             "\\usepackage{pdflscape}",
-             "\\usepackage{relsize}",
-             "\\usepackage{moresize}",
-             "\\usepackage[dvipsnames]{xcolor}",
-             "\\usepackage{color}",
-             "\\usepackage{amsmath}",
-             "\\usepackage{amssymb}",
-             "\\usepackage[many]{tcolorbox}",
-             "\\usepackage{afterpage}",
-             "\\usepackage{sectsty}",
-             "\\tcbuselibrary{listings}",
-             "\\geometry{letterpaper}",
-             "\\newtcblisting{code} {",
-             "listing only,",
-             "breakable,",
-             "boxrule = 1pt,",
-             "colframe = gray,",
-             "listing options = {",
-             "basicstyle = \\ttfamily\\relsize{-1},",
-             "breaklines = true,",
-             "columns = fullflexible,",
-             "commentstyle = \\color{olive},",
-             "keywordstyle = \\color{MidnightBlue},",
-             "stringstyle = \\color{OliveGreen},",
-             "breakatwhitespace = false,",
-             "keepspaces = true,",
-             "numbersep = 5pt,",
-             "showspaces = false,",
-             "showstringspaces = false,",
-             "showtabs = false,",
-             "tabsize = 2}} ",
-             "\\newtcblisting{codeoutput}{",
-             "listing only,",
-             "breakable,",
-             "colback = white,",
-             "boxrule = 1pt,",
-             "colframe = gray,",
-             "listing options = {",
-             "basicstyle =\\ttfamily\\relsize{-1},",
-             "breaklines = true,",
-             "columns = fullflexible}}",
-             "\\begin{document}"},
-        latexFooter = {"\\end{document}"},
-        startCode = {"\\begin{code}"},
-        endCode = {"\\end{code}\n"},
-        startOutput = {"\\begin{codeoutput}"},
-        endOutput = {"\\end{codeoutput}\n"},
-        startMath = {"\\["}, endMath = {"\\]~\\\\"},
-        startHeader = {"\\bf"}, endHeader;
+    constexpr static auto latexHeader =
+        std::to_array<std::string_view>({
+            "\\documentclass[10pt]{article}",
+            "\\usepackage[margin=1in]{geometry}",
+            "\\usepackage{background}",
+            "\\usepackage{csquotes}",
+            "\\usepackage{graphicx}",
+            "\\usepackage{hyperref}",
+            "\\usepackage{pdflscape}",
+            "\\usepackage{relsize}",
+            "\\usepackage{moresize}",
+            "\\usepackage[dvipsnames]{xcolor}",
+            "\\usepackage{color}",
+            "\\usepackage{amsmath}",
+            "\\usepackage{amssymb}",
+            "\\usepackage[many]{tcolorbox}",
+            "\\usepackage{afterpage}",
+            "\\usepackage{sectsty}",
+            "\\tcbuselibrary{listings}",
+            "\\geometry{letterpaper}",
+            "\\newtcblisting{code} {",
+            "listing only,",
+            "breakable,",
+            "boxrule = 1pt,",
+            "colframe = gray,",
+            "listing options = {",
+            "basicstyle = \\ttfamily\\relsize{-1},",
+            "breaklines = true,",
+            "columns = fullflexible,",
+            "commentstyle = \\color{olive},",
+            "keywordstyle = \\color{MidnightBlue},",
+            "stringstyle = \\color{OliveGreen},",
+            "breakatwhitespace = false,",
+            "keepspaces = true,",
+            "numbersep = 5pt,",
+            "showspaces = false,",
+            "showstringspaces = false,",
+            "showtabs = false,",
+            "tabsize = 2}} ",
+            "\\newtcblisting{codeoutput}{",
+            "listing only,",
+            "breakable,",
+            "colback = white,",
+            "boxrule = 1pt,",
+            "colframe = gray,",
+            "listing options = {",
+            "basicstyle =\\ttfamily\\relsize{-1},",
+            "breaklines = true,",
+            "columns = fullflexible}}",
+            "\\begin{document}"});
 
-    // did NOT have fun typing these
-    std::set<std::string> lstSupportedLangs = {
-        "ABAP",        "ACM",       "ACSL",        "ALGOL",
-        "ASSEMBLER",   "BASH",      "C",           "C++",
-        "CIL",         "COBOL",     "COMMAND.COM", "CSH",
-        "EIFFEL",      "ELISP",     "EUPHORIA",    "GAP",
-        "GNUPLOT",     "HANSL",     "HTML",        "INFORM",
-        "JVMIS",       "LINGO",     "LLVM",        "LUA",
-        "MATHEMATICA", "MERCURY",   "MIRANDA",     "ML",
-        "MUPAD",       "OBERON-2",  "OCTAVE",      "OZ",
-        "PERL",        "PL/I",      "POSTSCRIPT",  "PROLOG",
-        "PSTRICKS",    "R",         "REXX",        "RUBY",
-        "SAS",         "SCILAB",    "SHELXL",      "SPARQL",
-        "SWIFT",       "TEX",       "VBSCRIPT",    "VHDL",
-        "XML",         "ACMSCRIPT", "ADA",         "ANT",
-        "AWK",         "BASIC",     "CAML",        "CLEAN",
-        "COMSOL",      "DELPHI",    "ELAN",        "ERLANG",
-        "FORTRAN",     "GCL",       "GO",          "HASKELL",
-        "IDL",         "JAVA",      "KSH",         "LISP",
-        "LOGO",        "MAKE",      "MATLAB",      "METAPOST",
-        "MIZAR",       "MODULA-2",  "NASTRAN",     "OCL",
-        "OOREXX",      "PASCAL",    "PHP",         "PLASM",
-        "POV",         "PROMELA",   "PYTHON",      "REDUCE",
-        "RSL",         "S",         "SCALA",       "SH",
-        "SIMULA",      "SQL",       "TCL",         "VERILOG",
-        "VRML",        "XSLT"};
+    // Boxes styled as `code` and `codeoutput`, for blocks
+    // written to side files. Added to the header as needed.
+    constexpr static auto externalHeader =
+        std::to_array<std::string_view>({
+            "\\newtcbinputlisting{\\codefile}[1]{",
+            "listing only,",
+            "breakable,",
+            "boxrule = 1pt,",
+            "colframe = gray,",
+            "listing file = {#1},",
+            "listing options = {",
+            "basicstyle = \\ttfamily\\relsize{-1},",
+            "breaklines = true,",
+            "columns = fullflexible,",
+            "commentstyle = \\color{olive},",
+            "keywordstyle = \\color{MidnightBlue},",
+            "stringstyle = \\color{OliveGreen},",
+            "breakatwhitespace = false,",
+            "keepspaces = true,",
+            "numbersep = 5pt,",
+            "showspaces = false,",
+            "showstringspaces = false,",
+            "showtabs = false,",
+            "tabsize = 2}}",
+            "\\newtcbinputlisting{\\outputfile}[1]{",
+            "listing only,",
+            "breakable,",
+            "colback = white,",
+            "boxrule = 1pt,",
+            "colframe = gray,",
+            "listing file = {#1},",
+            "listing options = {",
+            "basicstyle =\\ttfamily\\relsize{-1},",
+            "breaklines = true,",
+            "columns = fullflexible}}"});
+
+    constexpr static auto latexFooter =
+        std::to_array<std::string_view>({"\\end{document}"});
+    constexpr static auto startCode =
+        std::to_array<std::string_view>({"\\begin{code}"});
+    constexpr static auto endCode =
+        std::to_array<std::string_view>({"\\end{code}\n"});
+    constexpr static auto startOutput =
+        std::to_array<std::string_view>(
+            {"\\begin{codeoutput}"});
+    constexpr static auto endOutput =
+        std::to_array<std::string_view>(
+            {"\\end{codeoutput}\n"});
+    constexpr static auto startMath =
+        std::to_array<std::string_view>({"\\["});
+    constexpr static auto endMath =
+        std::to_array<std::string_view>({"\\]~\\\\"});
+    constexpr static auto startHeader =
+        std::to_array<std::string_view>({"\\bf"});
+    constexpr static std::array<std::string_view, 0> endHeader =
+        {};
+
+    // Whether `listings` knows the given (uppercase) language.
+    // This is a constexpr perfect hash lookup.
+    static bool lst_supports(std::string_view _lang);
 
   protected:
     void knit(const std::list<Chunk> &_chunks);
 
+    // Also removes the side files the target no longer uses
+    void save_target() override;
+
   private:
     void handle_md(const std::list<std::string> &_lines,
                    std::ostream &_target);
+    void write_text(std::string_view _line,
+                    std::ostream &_target);
+
+    // If the given block is over `externalize_lines` long,
+    // write it to a side file named for its hash and return its
+    // path relative to the target. Otherwise, return nothing.
+    std::string
+    externalize(const std::list<std::string> &_lines);
+
+    // The side files used by the last knit, as returned by
+    // `externalize`
+    std::set<std::string> blocks;
 };